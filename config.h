@@ -25,6 +25,14 @@ static unsigned int lines      = 0;
 static unsigned int maxhist    = 64;
 static int histnodup           = 1;	/* if 0, record repeated histories */
 static unsigned int columns    = 0;
+/* item count from which matching runs on threads, away from the event loop */
+static unsigned int parallelmin = 50000;
+/* item count from which -F matching uses a trigram index, 0 for never */
+static unsigned int indexmin = 100000;
+/* -C option; directory keeping processed input for the next run, NULL for none */
+static const char *cachedir = NULL;
+/* snapshots kept in cachedir, the ones used least recently are removed */
+static unsigned int cachemax = 32;
 /* -h option; minimum height of a menu line */
 static unsigned int lineheight = 0;
 static unsigned int min_lineheight = 8;
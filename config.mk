@@ -27,7 +27,7 @@ EXTRAFLAGS=-D_GNU_SOURCE
 
 # includes and libs
 INCS = -I$(X11INC) -I$(FREETYPEINC) $(JANSSONINC)
-LIBS = -L$(X11LIB) -lX11 $(XINERAMALIBS) $(FREETYPELIBS) -lm  $(JANSSONLIBS)
+LIBS = -L$(X11LIB) -lX11 $(XINERAMALIBS) $(FREETYPELIBS) -lm -lpthread $(JANSSONLIBS)
 
 # flags
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DVERSION=\"$(VERSION)\" $(XINERAMAFLAGS) $(EXTRAFLAGS)
@@ -1,11 +1,24 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
@@ -30,32 +43,187 @@
 #define TEXTW(X)              (drw_fontset_getwidth(drw, (X)) + lrpad)
 #define NUMBERSMAXDIGITS      100
 #define NUMBERSBUFSIZE        (NUMBERSMAXDIGITS * 2) + 1
+#define STREAMBUDGET          16000000 /* ns spent reading stdin per event loop pass */
+#define IDLEBUDGET            8000000  /* ns spent measuring items per idle pass */
+#define MATCHCHUNK            16384    /* items per matching task */
+#define ARENACHUNK            (1 << 20) /* bytes of item text per arena chunk */
+#define RANKTOP               256      /* fuzzy matches ranked on each keystroke, at least */
+#define RANKONE               (1 << 20) /* 1 in fixed point fuzzy distances */
+#define TRIBITS               18       /* log2 of the trigram index buckets */
+#define TRIBUCKETS            (1 << TRIBITS)
+#define ONES                  ((uint64_t)-1 / 255)
+#define HASZERO(x)            (((x) - ONES) & ~(x) & (ONES << 7)) /* nonzero if a byte of x is */
+#define MATCH(i)              (&items[shown.v[(i)].n]) /* item at position i of the matches */
 
 /* enums */
 enum { SchemeNorm, SchemeSel, SchemeHp, SchemeOut, SchemeNormHighlight, SchemeSelHighlight, SchemeOutHighlight, SchemeLast }; /* color schemes */
+enum { ItemHp = 1 << 0 }; /* item flags */
+
+/* cold item data, only touched for matched and visible items */
 struct item {
 	char *text;
-	struct item *left, *right;
-	int out, hp;
-	double distance;
+	int out;
+	unsigned int w; /* TEXTW() of text, 0 until measured */
+	uint64_t distance; /* fixed point fuzzy rank, lower first */
 	json_t *json;
 	int id; /* for multiselect */
 };
 
+/* hot item data scanned by the matchers, indexed like items */
+struct hot {
+	char **text;
+	unsigned int *len;
+	unsigned char *flags;
+	uint64_t *sig; /* bytes in text, see textsig() */
+};
+
 static char **hpitems = NULL;
 static int hplength = 0;
+/* every prefix of the hp items, hashed by hpcompile() */
+static struct hpprefix {
+	const char *s; /* hp item the prefix is taken from */
+	size_t len;
+	unsigned int hash;
+	int whole; /* the prefix is the whole hp item */
+} *hpset;
+static size_t hpsetsz;
 static char numbers[NUMBERSBUFSIZE] = "";
 static char text[BUFSIZ] = "";
 static char *embed;
 static int bh, mw, mh;
 static int inputw = 0, promptw, passwd = 0;
+static int stream = 0; /* -s option; still reading items in run() */
+static int stdinflags = -1; /* of stdin before -s made it non-blocking */
+/* set by the events run() handles, done once none are queued */
+static int matchpending, drawpending;
+/* what the last frame shows, so that drawmenu() redraws only what changed */
+static struct {
+	int all; /* everything is to be redrawn */
+	char text[sizeof text], numbers[NUMBERSBUFSIZE];
+	size_t cursor;
+	unsigned long hlgen; /* hl.gen of the highlights drawn */
+	struct cell {
+		const char *s; /* text of the item in the cell, NULL if empty */
+		int scheme;
+	} *cells; /* the grid, column by column */
+	size_t ncells;
+	int x, y, w, h; /* area to map, grown by damage() */
+} drawn = { .all = 1 };
+static char *sbuf; /* partial line carried over between stdin reads */
+static size_t sbuflen, sbufsz;
+static unsigned int widest; /* widest item measured so far */
+static size_t ilongest, measured; /* item with the most bytes, items measured */
+static int areax, areay, areaw, areah; /* screen area a centered menu is placed in */
 static int lrpad; /* sum of left and right padding */
 static size_t cursor;
-static size_t items_sz = 0;
+static size_t items_sz = 0; /* allocated items */
 static size_t items_ln = 0;
 static struct item *items = NULL, *backup_items;
-static struct item *matches, *matchend;
-static struct item *prev, *curr, *next, *sel;
+static struct hot hot, backup_hot;
+static size_t backup_sz, backup_ln;
+/* items that matched candtext, in item order, and the items_ln they were
+ * taken from; reset both counts to rescan every item */
+static size_t *cand, ncand, candsz, candscanned;
+static char candtext[sizeof text];
+/* trigram index for match(), built by indexitems() once stdin is read:
+ * the ids + 1 of the items holding each trigram, folded with tolower()
+ * and hashed to a bucket, as varint deltas from data[off[b]] up to
+ * data[off[b + 1]] */
+static struct {
+	size_t *off, *fill; /* fill: where the next id of a bucket goes */
+	unsigned char *data;
+	uint32_t *last; /* last id + 1 added to each bucket */
+	size_t n; /* items done in this pass */
+	int pass; /* 0 counts the bytes of each bucket, 1 fills them, 2 done */
+	size_t *hits, hitssz; /* trinarrow() candidates */
+} tri;
+/* matches of each chunk of items tested by testitems() */
+static struct result {
+	size_t *v; /* item indices */
+	unsigned char *b; /* match() buckets */
+	size_t n, sz;
+} *results;
+static size_t resultssz, nscan;
+static int (*testitem)(size_t);
+static char **tokv; /* match() tokens */
+static int tokc, textlen;
+static uint64_t qsig; /* textsig() of what an item has to contain */
+static size_t tok0len;
+static struct needle {
+	unsigned char a, b; /* the text byte and its other case */
+	int n; /* number of bytes matching a */
+} needles[sizeof text]; /* fuzzymatch() text bytes */
+static unsigned int logtab[1024]; /* RANKONE * log(i + 2) */
+/* matches as item indices and fuzzy distances; the first nranked are
+ * in order and before the others, which rankrest() sorts once needed */
+struct order {
+	struct rank {
+		uint64_t d;
+		size_t n;
+	} *v;
+	size_t n, nranked, sz;
+};
+static struct order shown, computed; /* shown in the menu, being matched */
+static char qtext[sizeof text]; /* the text being matched */
+/* what the shown matches were matched against, for drawhighlights():
+ * the text with its tokens NUL-separated unless fuzzy, and the byte
+ * ranges of the item being drawn that matchranges() found */
+static struct {
+	char text[sizeof text];
+	size_t len;
+	unsigned long gen; /* bumped by each matchshow() */
+	struct needle needles[sizeof text];
+	struct range {
+		size_t a, b;
+	} r[sizeof text];
+} hl;
+static int candguess; /* cand came from trinarrow() and is not verified yet */
+/* thread matching large item sets away from run(); gen counts the
+ * requests, taken is the last one started and donegen the last one
+ * finished, and a byte on fd[0] tells run() a match is done */
+static struct {
+	pthread_t thread;
+	int started, busy, fd[2];
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	unsigned long gen, taken, donegen;
+	char text[sizeof text]; /* the text requested */
+} matcher = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+static unsigned long computegen, showngen;
+/* workers for matching large item sets */
+static struct {
+	pthread_t *threads;
+	int nthreads, busy;
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	unsigned long gen; /* bumped for each job */
+	size_t next, nchunks;
+	void (*fn)(size_t);
+} pool;
+static struct chunk {
+	struct chunk *next;
+	size_t len, cap;
+	char buf[];
+} *arena; /* item text, freed in one go */
+static char *map; /* stdin when it is a regular file */
+static size_t mapsz;
+/* snapshot of processed input in cachedir, see cacheload() */
+static struct cachehdr {
+	char magic[8];
+	uint64_t key; /* inputkey() */
+	uint64_t n, textsz, widest, ilongest;
+} *cache;
+static size_t cachesz;
+static uint64_t cachekey;
+static int cachewanted; /* save a snapshot once the items are measured */
+/* positions in the shown matches of the selection, the first match of
+ * the page, of the next page and of the previous one; next is shown.n on
+ * the last page and sel is only valid while there are matches */
+static size_t prev, curr, next, sel;
 static int mon = -1, screen;
 
 static int *selid = NULL;
@@ -64,6 +232,7 @@ static unsigned int selidsize = 0;
 static Atom clip, utf8;
 static Display *dpy;
 static Window root, parentwin, win;
+static XIM xim;
 static XIC xic;
 
 static Drw *drw;
@@ -101,27 +270,161 @@ tokenize(char *source, const char *delim, int *llen) {
 	return list;
 }
 
+static unsigned int
+hphash(unsigned int hash, char c)
+{
+	/* FNV-1a, folded like fstrncmp compares */
+	if (fstrncmp == strncasecmp)
+		c = tolower((unsigned char)c);
+	return (hash ^ (unsigned char)c) * 16777619;
+}
+
+static struct hpprefix *
+hpfind(const char *s, size_t len, unsigned int hash)
+{
+	struct hpprefix *p;
+
+	for (p = &hpset[hash & (hpsetsz - 1)]; p->s; p = (p == &hpset[hpsetsz - 1]) ? hpset : p + 1)
+		if (p->hash == hash && p->len == len && !fstrncmp(p->s, s, len))
+			return p;
+	return p;
+}
+
+static void
+hpcompile(void)
+{
+	struct hpprefix *p;
+	size_t n = 0, len, j;
+	unsigned int hash;
+	int i;
+
+	for (i = 0; i < hplength; i++)
+		n += strlen(hpitems[i]) + 1;
+	for (hpsetsz = 16; hpsetsz < 2 * n; hpsetsz *= 2)
+		;
+	hpset = ecalloc(hpsetsz, sizeof *hpset);
+	for (i = 0; i < hplength; i++) {
+		len = strlen(hpitems[i]);
+		for (j = 0, hash = 2166136261; j <= len; hash = hphash(hash, hpitems[i][j++])) {
+			if (!(p = hpfind(hpitems[i], j, hash))->s) {
+				p->s = hpitems[i];
+				p->len = j;
+				p->hash = hash;
+			}
+			p->whole |= j == len;
+		}
+	}
+}
+
+/* whether an item starts with an hp item or is the start of one */
 static int
-arrayhas(char **list, int length, char *item) {
-	for (int i = 0; i < length; i++) {
-		int len1 = strlen(list[i]);
-		int len2 = strlen(item);
-		if (fstrncmp(list[i], item, len1 > len2 ? len2 : len1) == 0)
+ishp(const char *s, size_t len)
+{
+	struct hpprefix *p;
+	unsigned int hash = 2166136261;
+	size_t i;
+
+	if (!hplength)
+		return 0;
+	/* no longer prefix of s can be in the set once one is missing */
+	for (i = 0; (p = hpfind(s, i, hash))->s; hash = hphash(hash, s[i++]))
+		if (p->whole || i == len)
 			return 1;
-	}
 	return 0;
 }
 
 static void listjson(json_t *obj);
 static json_t *json = NULL;
 
+/* Returns a bit for each lower case letter and digit in the len bytes at
+ * s, and one of 28 bits shared by the other bytes. Bytes are folded with
+ * tolower() first so that bytes fstrncmp() and fstrstr() take as equal
+ * set the same bit: text cannot match an item lacking one of its bits. */
+static uint64_t
+textsig(const char *s, size_t len)
+{
+	static uint64_t bit[256];
+	uint64_t sig = 0;
+	int c, l;
+
+	if (!bit[0])
+		for (c = 0; c < 256; c++) {
+			l = tolower(c);
+			if (l >= 'a' && l <= 'z')
+				bit[c] = (uint64_t)1 << (l - 'a');
+			else if (l >= '0' && l <= '9')
+				bit[c] = (uint64_t)1 << (26 + l - '0');
+			else
+				bit[c] = (uint64_t)1 << (36 + l % 28);
+		}
+	while (len--)
+		sig |= bit[(unsigned char)*s++];
+	return sig;
+}
+
+/* makes room for n more items */
+static void
+itemsgrow(size_t n)
+{
+	if (items_ln + n >= items_sz) {
+		items_sz = MAX(items_sz ? items_sz * 2 : 256, items_ln + n + 1);
+		if (!(items = realloc(items, items_sz * sizeof *items)) ||
+		    !(hot.text = realloc(hot.text, items_sz * sizeof *hot.text)) ||
+		    !(hot.len = realloc(hot.len, items_sz * sizeof *hot.len)) ||
+		    !(hot.flags = realloc(hot.flags, items_sz * sizeof *hot.flags)) ||
+		    !(hot.sig = realloc(hot.sig, items_sz * sizeof *hot.sig)))
+			die("cannot realloc %u items:", items_sz);
+	}
+}
+
 static struct item *
-itemnew(void)
+itemnew(char *s, size_t len)
+{
+	struct item *item;
+
+	itemsgrow(1);
+	hot.text[items_ln] = s;
+	hot.len[items_ln] = len;
+	hot.flags[items_ln] = 0;
+	hot.sig[items_ln] = textsig(s, len);
+	item = &items[items_ln];
+	item->text = s;
+	item->json = NULL;
+	item->out = 0;
+	item->w = 0;
+	item->id = items_ln++; /* for multiselect */
+	return item;
+}
+
+static void
+freeitems(struct item *list, struct hot *h)
+{
+	free(list);
+	free(h->text);
+	free(h->len);
+	free(h->flags);
+	free(h->sig);
+}
+
+static char *
+arenadup(const char *s, size_t len)
 {
-	if (items_ln + 1 >= (items_sz / sizeof *items))
-		if (!(items = realloc(items, (items_sz += BUFSIZ))))
-			die("cannot realloc %u bytes:", items_sz);
-	return &items[items_ln++];
+	struct chunk *c;
+	char *p;
+
+	if (!arena || arena->len + len + 1 > arena->cap) {
+		if (!(c = malloc(sizeof *c + MAX(ARENACHUNK, len + 1))))
+			die("cannot malloc %u bytes:", sizeof *c + MAX(ARENACHUNK, len + 1));
+		c->len = 0;
+		c->cap = MAX(ARENACHUNK, len + 1);
+		c->next = arena;
+		arena = c;
+	}
+	p = arena->buf + arena->len;
+	memcpy(p, s, len);
+	p[len] = '\0';
+	arena->len += len + 1;
+	return p;
 }
 
 static int
@@ -133,51 +436,121 @@ issel(size_t id)
 	return 0;
 }
 
-static void
-appenditem(struct item *item, struct item **list, struct item **last)
+/* the selected item, NULL without matches */
+static struct item *
+selitem(void)
 {
-	if (*last)
-		(*last)->right = item;
-	else
-		*list = item;
+	return sel < shown.n ? MATCH(sel) : NULL;
+}
 
-	item->left = *last;
-	item->right = NULL;
-	*last = item;
+static unsigned int
+itemw(struct item *item)
+{
+	if (!item->w)
+		item->w = TEXTW(item->text);
+	return item->w;
 }
 
+static void rankrest(void);
+
 static void
 calcoffsets(void)
 {
+	size_t k;
 	int i, n;
 
-	if (lines > 0)
-		n = lines * columns * bh;
-	else
-		n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
+	if (lines > 0) {
+		/* pages are a grid of items */
+		n = lines * columns;
+		if (shown.nranked < shown.n && shown.nranked <= curr + 2 * n)
+			rankrest();
+		next = MIN(curr + n, shown.n);
+		prev = curr - MIN(curr, n);
+		return;
+	}
+	n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
+	/* rank the rest of the matches before this page or the next one reaches them */
+	if (shown.nranked < shown.n) {
+		for (i = 0, k = curr; k < shown.nranked; k++)
+			if ((i += MIN(itemw(MATCH(k)), n)) > 2 * n)
+				break;
+		if (k == shown.nranked)
+			rankrest();
+	}
 	/* calculate which items will begin the next page and previous page */
-	for (i = 0, next = curr; next; next = next->right)
-		if ((i += (lines > 0) ? bh : MIN(TEXTW(next->text), n)) > n)
+	for (i = 0, next = curr; next < shown.n; next++)
+		if ((i += MIN(itemw(MATCH(next)), n)) > n)
 			break;
-	for (i = 0, prev = curr; prev && prev->left; prev = prev->left)
-		if ((i += (lines > 0) ? bh : MIN(TEXTW(prev->left->text), n)) > n)
+	for (i = 0, prev = curr; prev > 0; prev--)
+		if ((i += MIN(itemw(MATCH(prev - 1)), n)) > n)
 			break;
 }
 
-static int
-max_textw(void)
+/* makes curr begin the page that ends with the last match */
+static void
+lastpage(void)
+{
+	int i, n;
+
+	if (lines > 0) {
+		n = lines * columns;
+		curr = shown.n - MIN(shown.n, n);
+	} else {
+		n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
+		for (i = 0, curr = shown.n; curr > 0; curr--)
+			if ((i += MIN(itemw(MATCH(curr - 1)), n)) > n)
+				break;
+	}
+	calcoffsets();
+}
+
+/* guess the widest item from the one with the most bytes, measureitems()
+ * refines it once the menu is shown */
+static void
+estimatewidth(void)
+{
+	if (items_ln)
+		widest = MAX(widest, itemw(&items[ilongest]));
+}
+
+static void
+centergeom(int *x, int *y)
 {
-	int len = 0;
-	for (struct item *item = items; item && item->text; item++)
-		len = MAX(TEXTW(item->text), len);
-	return len;
+	mw = MIN(MAX(widest + promptw, min_width), areaw);
+	*x = areax + (areaw - mw) / 2;
+	*y = areay + (areah - mh) / 2;
 }
 
+/* follow a change of widest in the input field and a centered window */
+static void
+updatewidth(void)
+{
+	int x, y, oldmw = mw;
+
+	if (centered) {
+		centergeom(&x, &y);
+		if (mw != oldmw) {
+			XMoveResizeWindow(dpy, win, x, y, mw, mh);
+			drw_resize(drw, mw, mh);
+			drawn.all = 1;
+		}
+	}
+	inputw = MIN(widest, mw / 3);
+}
+
+static void matchstop(void);
+
 static void
 cleanup(void)
 {
 	size_t i;
 
+	/* the matcher thread reads the items freed below */
+	if (matcher.started)
+		matchstop();
+	/* the flags belong to the open file, shared with whoever else holds it */
+	if (stdinflags != -1)
+		fcntl(STDIN_FILENO, F_SETFL, stdinflags);
 	XUngrabKey(dpy, AnyKey, AnyModifier, root);
 	// for (i = 0; i < SchemeLast; i++)
 	// 	free(scheme[i]);
@@ -185,6 +558,14 @@ cleanup(void)
 	XSync(dpy, False);
 	XCloseDisplay(dpy);
 	free(selid);
+	for (struct chunk *c; (c = arena); free(c))
+		arena = c->next;
+	if (map)
+		munmap(map, mapsz);
+	if (cache)
+		munmap(cache, cachesz);
+	freeitems(items, &hot);
+	freeitems(backup_items, &backup_hot);
 }
 
 static char *
@@ -198,138 +579,204 @@ cistrstr(const char *s, const char *sub)
 	return NULL;
 }
 
+static size_t matchranges(size_t n);
+
 static void
 drawhighlights(struct item *item, int x, int y, int maxw)
 {
-	int i, indent;
-	char *highlight;
-	char c;
+	char buf[sizeof text];
+	size_t i, nr, len, pos = 0;
+	int indent = 0, w;
 
-	if (!(strlen(item->text) && strlen(text)))
+	if (!(hot.len[item - items] && hl.len))
 		return;
 
-	drw_setscheme(drw, scheme[item == sel
+	drw_setscheme(drw, scheme[item == selitem()
 	                   ? SchemeSelHighlight
 	                   : SchemeNormHighlight]);
-	for (i = 0, highlight = item->text; *highlight && text[i];) {
-		if (!fstrncmp(&(*highlight), &text[i], 1)) {
-			/* get indentation */
-			c = *highlight;
-			*highlight = '\0';
-			indent = TEXTW(item->text);
-			*highlight = c;
-
-			/* highlight character */
-			c = highlight[1];
-			highlight[1] = '\0';
-			drw_text(
-				drw,
-				x + indent - (lrpad / 2),
-				y,
-				MIN(maxw - indent, TEXTW(highlight) - lrpad),
-				bh, 0, highlight, 0
-			);
-			highlight[1] = c;
-			i++;
-		}
-		highlight++;
+	/* advance from range to range, measuring each byte once */
+	nr = matchranges(item - items);
+	for (i = 0; i < nr; i++) {
+		indent += drw_fontset_getwidth_n(drw, item->text + pos, hl.r[i].a - pos);
+		len = MIN(hl.r[i].b - hl.r[i].a, sizeof buf - 1);
+		memcpy(buf, item->text + hl.r[i].a, len);
+		buf[len] = '\0';
+		w = drw_fontset_getwidth(drw, buf);
+		if (maxw - indent - lrpad <= 0)
+			break;
+		drw_text(drw, x + indent + lrpad / 2, y,
+		         MIN(maxw - indent - lrpad, w), bh, 0, buf, 0);
+		indent += w;
+		pos = hl.r[i].b;
 	}
 }
 
 static int
-drawitem(struct item *item, int x, int y, int w)
+itemscheme(struct item *item)
 {
-	if (item == sel)
-		drw_setscheme(drw, scheme[SchemeSel]);
+	if (item == selitem())
+		return SchemeSel;
 	else if (issel(item->id))
-		drw_setscheme(drw, scheme[SchemeOut]);
-	else if (item->hp)
-		drw_setscheme(drw, scheme[SchemeHp]);
+		return SchemeOut;
+	else if (hot.flags[item - items] & ItemHp)
+		return SchemeHp;
 	else
-		drw_setscheme(drw, scheme[SchemeNorm]);
+		return SchemeNorm;
+}
+
+static int
+drawitem(struct item *item, int x, int y, int w)
+{
+	drw_setscheme(drw, scheme[itemscheme(item)]);
 
 	int r = drw_text(drw, x, y, w, bh, lrpad / 2, item->text, 0);
 	drawhighlights(item, x, y, w);
 	return r;
 }
 
+static int matchbusy(void);
+
 static void
 recalculatenumbers()
 {
-	unsigned int numer = 0, denom = 0;
-	struct item *item;
-	if (matchend) {
-		numer++;
-		for (item = matchend; item && item->left; item = item->left)
-			numer++;
+	static unsigned int spin;
+	unsigned int numer = shown.n, denom = items_ln;
+
+	if (matchpending || (matcher.started && matchbusy()))
+		snprintf(numbers, NUMBERSBUFSIZE, "%c %d/%d", "|/-\\"[spin++ % 4], numer, denom);
+	else
+		snprintf(numbers, NUMBERSBUFSIZE, "%d/%d", numer, denom);
+}
+
+/* maps the pending area when the next one does not extend it downwards */
+static void
+damage(int x, int y, int w, int h)
+{
+	if (drawn.h && x == drawn.x && w == drawn.w && y == drawn.y + drawn.h) {
+		drawn.h += h;
+		return;
 	}
-	for (item = items; item && item->text; item++)
-		denom++;
-	snprintf(numbers, NUMBERSBUFSIZE, "%d/%d", numer, denom);
+	if (drawn.h)
+		drw_copy(drw, win, drawn.x, drawn.y, drawn.w, drawn.h);
+	drawn.x = x;
+	drawn.y = y;
+	drawn.w = w;
+	drawn.h = h;
 }
 
 static void
 drawmenu(void)
 {
 	unsigned int curpos;
-	struct item *item;
-	int x = 0, y = 0, fh = drw->fonts->h, w;
+	struct item *it;
+	size_t k;
+	int x = 0, y = 0, fh = drw->fonts->h, w, i, n, cx, cy, sch, top, textchanged, hlchanged;
 	char *censort;
 
+	drawpending = 0;
+	recalculatenumbers();
+	/* the horizontal list shares the input line and is redrawn whole */
+	if (lines <= 0)
+		drawn.all = 1;
+	textchanged = strcmp(drawn.text, text) != 0;
+	/* matches from the matcher thread come after the text that asked for them */
+	hlchanged = textchanged || drawn.hlgen != hl.gen;
+	top = drawn.all || textchanged || drawn.cursor != cursor || strcmp(drawn.numbers, numbers);
+
 	drw_setscheme(drw, scheme[SchemeNorm]);
-	drw_rect(drw, 0, 0, mw, mh, 1, 1);
+	if (drawn.all)
+		drw_rect(drw, 0, 0, mw, mh, 1, 1);
+	else if (top)
+		drw_rect(drw, 0, 0, mw, bh, 1, 1);
 
 	if (prompt && *prompt) {
 		drw_setscheme(drw, scheme[SchemeSel]);
-		x = drw_text(drw, x, 0, promptw, bh, lrpad / 2, prompt, 0);
+		x = top ? drw_text(drw, x, 0, promptw, bh, lrpad / 2, prompt, 0) : x + promptw;
 	}
 	/* draw input field */
-	w = (lines > 0 || !matches) ? mw - x : inputw;
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	if (passwd) {
-	        censort = ecalloc(1, sizeof(text));
-		memset(censort, '.', strlen(text));
-		drw_text(drw, x, 0, w, bh, lrpad / 2, censort, 0);
-		free(censort);
-	} else drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0);
-
-	curpos = TEXTW(text) - TEXTW(&text[cursor]);
-	if ((curpos += lrpad / 2 - 1) < w) {
+	w = (lines > 0 || !shown.n) ? mw - x : inputw;
+	if (top) {
 		drw_setscheme(drw, scheme[SchemeNorm]);
-		drw_rect(drw, x + curpos, 2 + (bh - fh) / 2, 2, fh - 4, 1, 0);
+		if (passwd) {
+		        censort = ecalloc(1, sizeof(text));
+			memset(censort, '.', strlen(text));
+			drw_text(drw, x, 0, w, bh, lrpad / 2, censort, 0);
+			free(censort);
+		} else drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0);
+
+		curpos = TEXTW(text) - TEXTW(&text[cursor]);
+		if ((curpos += lrpad / 2 - 1) < w) {
+			drw_setscheme(drw, scheme[SchemeNorm]);
+			drw_rect(drw, x + curpos, 2 + (bh - fh) / 2, 2, fh - 4, 1, 0);
+		}
 	}
 
-	recalculatenumbers();
 	if (lines > 0) {
-		/* draw grid */
-		int i = 0;
-		for (item = curr; item != next; item = item->right, i++)
-			drawitem(
-				item,
-				x + ((i / lines) *  ((mw - x) / columns)),
-				y + (((i % lines) + 1) * bh),
-				(mw - x) / columns
-			);
-	} else if (matches) {
+		/* draw grid, only the cells that changed unless the
+		 * text or the highlights did */
+		n = lines * columns;
+		if (drawn.ncells < n) {
+			if (!(drawn.cells = realloc(drawn.cells, n * sizeof *drawn.cells)))
+				die("cannot realloc %u bytes:", n * sizeof *drawn.cells);
+			drawn.ncells = n;
+			drawn.all = 1;
+		}
+		w = (mw - x) / columns;
+		for (i = 0, k = curr; i < n; i++) {
+			it = k < next ? MATCH(k) : NULL;
+			sch = it ? itemscheme(it) : -1;
+			if (drawn.all || hlchanged || drawn.cells[i].scheme != sch ||
+			    drawn.cells[i].s != (it ? it->text : NULL)) {
+				cx = x + ((i / lines) * w);
+				cy = y + (((i % lines) + 1) * bh);
+				if (!drawn.all) {
+					drw_setscheme(drw, scheme[SchemeNorm]);
+					drw_rect(drw, cx, cy, w, bh, 1, 1);
+					damage(cx, cy, w, bh);
+				}
+				if (it)
+					drawitem(it, cx, cy, w);
+				drawn.cells[i].s = it ? it->text : NULL;
+				drawn.cells[i].scheme = sch;
+			}
+			if (it)
+				k++;
+		}
+	} else if (shown.n) {
 		/* draw horizontal list */
 		x += inputw;
 		w = TEXTW("<");
-		if (curr->left) {
+		if (curr > 0) {
 			drw_setscheme(drw, scheme[SchemeNorm]);
 			drw_text(drw, x, 0, w, bh, lrpad / 2, "<", 0);
 		}
 		x += w;
-		for (item = curr; item != next; item = item->right)
-			x = drawitem(item, x, 0, MIN(TEXTW(item->text), mw - x - TEXTW(">") - TEXTW(numbers)));
-		if (next) {
+		for (k = curr; k < next; k++)
+			x = drawitem(MATCH(k), x, 0, MIN(itemw(MATCH(k)), mw - x - TEXTW(">") - TEXTW(numbers)));
+		if (next < shown.n) {
 			w = TEXTW(">");
 			drw_setscheme(drw, scheme[SchemeNorm]);
 			drw_text(drw, mw - w - TEXTW(numbers), 0, w, bh, lrpad / 2, ">", 0);
 		}
 	}
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	drw_text(drw, mw - TEXTW(numbers), 0, TEXTW(numbers), bh, lrpad / 2, numbers, 0);
-	drw_map(drw, win, 0, 0, mw, mh);
+	if (top) {
+		drw_setscheme(drw, scheme[SchemeNorm]);
+		drw_text(drw, mw - TEXTW(numbers), 0, TEXTW(numbers), bh, lrpad / 2, numbers, 0);
+	}
+
+	if (drawn.all) {
+		drw_map(drw, win, 0, 0, mw, mh);
+	} else {
+		if (top)
+			drw_copy(drw, win, 0, 0, mw, bh);
+		damage(0, 0, 0, 0);
+		XSync(dpy, False);
+	}
+	drawn.all = 0;
+	strcpy(drawn.text, text);
+	strcpy(drawn.numbers, numbers);
+	drawn.cursor = cursor;
+	drawn.hlgen = hl.gen;
 }
 
 static void
@@ -367,155 +814,700 @@ grabkeyboard(void)
 	die("cannot grab keyboard");
 }
 
-int
-compare_distance(const void *a, const void *b)
+/* reads the next id of a bucket from *p */
+static uint32_t
+trinext(const unsigned char **p, uint32_t id)
 {
-	struct item *da = *(struct item **) a;
-	struct item *db = *(struct item **) b;
+	uint32_t d = 0;
+	int sh = 0;
 
-	if (!db)
-		return 1;
-	if (!da)
-		return -1;
+	for (; **p & 128; sh += 7)
+		d |= (uint32_t)(*(*p)++ & 127) << sh;
+	return id + (d | (uint32_t)*(*p)++ << sh);
+}
 
-	return da->distance == db->distance ? 0 : da->distance < db->distance ? -1 : 1;
+static int
+tricmp(const void *a, const void *b)
+{
+	uint32_t ba = *(const uint32_t *)a, bb = *(const uint32_t *)b;
+	size_t la = tri.off[ba + 1] - tri.off[ba], lb = tri.off[bb + 1] - tri.off[bb];
+
+	return la != lb ? (la < lb ? -1 : 1) : (ba > bb) - (ba < bb);
 }
 
-void
-fuzzymatch(void)
+/* Replaces the candidates with the indexed items holding every trigram
+ * of the tokens, when there are fewer of them. Buckets are intersected
+ * from the shortest while that is cheaper than testing the items left. */
+static void
+trinarrow(void)
 {
-	/* bang - we have so much memory */
-	struct item *it;
-	struct item **fuzzymatches = NULL;
-	char c;
-	int number_of_matches = 0, i, pidx, sidx, eidx;
-	int text_len = strlen(text), itext_len;
-
-	matches = matchend = NULL;
-
-	/* walk through all items */
-	for (it = items; it && it->text; it++) {
-		if (text_len) {
-			itext_len = strlen(it->text);
-			pidx = 0; /* pointer */
-			sidx = eidx = -1; /* start of match, end of match */
-			/* walk through item text */
-			for (i = 0; i < itext_len && (c = it->text[i]); i++) {
-				/* fuzzy match pattern */
-				if (!fstrncmp(&text[pidx], &c, 1)) {
-					if(sidx == -1)
-						sidx = i;
-					pidx++;
-					if (pidx == text_len) {
-						eidx = i;
-						break;
-					}
-				}
-			}
-			/* build list of matches */
-			if (eidx != -1) {
-				/* compute distance */
-				/* add penalty if match starts late (log(sidx+2))
-				 * add penalty for long a match without many matching characters */
-				it->distance = (it->hp ? 0 : 1 ) * (1 + log(sidx + 2) + (double)(eidx - sidx - text_len));
-				/* fprintf(stderr, "distance %s %f\n", it->text, it->distance); */
-				appenditem(it, &matches, &matchend);
-				number_of_matches++;
-			}
-		} else {
-			appenditem(it, &matches, &matchend);
+	uint32_t qb[sizeof text], key, id;
+	const unsigned char *p, *end;
+	size_t *t, i, j, k, n, nq = 0, cur = ncand + items_ln - candscanned;
+	int c;
+
+	if (tri.pass != 2 || tri.n != items_ln || backup_items)
+		return;
+	for (i = 0; i < tokc; i++) {
+		for (key = 0, j = 0; (c = (unsigned char)tokv[i][j]); j++) {
+			key = (key << 8 | tolower(c)) & 0xffffff;
+			if (j >= 2)
+				qb[nq++] = key * 2654435761U >> (32 - TRIBITS);
 		}
 	}
+	if (!nq)
+		return;
+	qsort(qb, nq, sizeof *qb, tricmp);
+	/* an id takes 1 to 5 bytes */
+	if ((tri.off[qb[0] + 1] - tri.off[qb[0]]) / 5 >= cur)
+		return;
 
-	if (number_of_matches) {
-		/* initialize array with matches */
-		if (!(fuzzymatches = realloc(fuzzymatches, number_of_matches * sizeof(struct item*))))
-			die("cannot realloc %u bytes:", number_of_matches * sizeof(struct item*));
-		for (i = 0, it = matches; it && i < number_of_matches; i++, it = it->right) {
-			fuzzymatches[i] = it;
+	if (tri.hitssz < items_sz &&
+	    !(tri.hits = realloc(tri.hits, (tri.hitssz = items_sz) * sizeof *tri.hits)))
+		die("cannot realloc %u bytes:", tri.hitssz * sizeof *tri.hits);
+	p = tri.data + tri.off[qb[0]];
+	end = tri.data + tri.off[qb[0] + 1];
+	for (n = 0, id = 0; p < end; n++)
+		tri.hits[n] = (id = trinext(&p, id)) - 1;
+	for (i = 1; i < nq && n; i++) {
+		if (qb[i] == qb[i - 1])
+			continue;
+		if (tri.off[qb[i] + 1] - tri.off[qb[i]] > 32 * n)
+			break;
+		p = tri.data + tri.off[qb[i]];
+		end = tri.data + tri.off[qb[i] + 1];
+		for (j = k = 0, id = 0; p < end && j < n;) {
+			id = trinext(&p, id);
+			while (j < n && tri.hits[j] < id - 1)
+				j++;
+			if (j < n && tri.hits[j] == id - 1)
+				tri.hits[k++] = tri.hits[j++];
 		}
-		/* sort matches according to distance */
-		qsort(fuzzymatches, number_of_matches, sizeof(struct item*), compare_distance);
-		/* rebuild list of matches */
-		matches = matchend = NULL;
-		for (i = 0, it = fuzzymatches[i];  i < number_of_matches && it && \
-				it->text; i++, it = fuzzymatches[i]) {
-			appenditem(it, &matches, &matchend);
+		n = k;
+	}
+	if (n >= cur)
+		return;
+	t = cand;
+	cand = tri.hits;
+	tri.hits = t;
+	k = candsz;
+	candsz = tri.hitssz;
+	tri.hitssz = k;
+	ncand = n;
+	candscanned = items_ln;
+	candguess = 1;
+}
+
+/* drops the trigram index when the items are replaced */
+static void
+indexreset(void)
+{
+	tri.n = tri.pass = 0;
+	if (tri.off) {
+		memset(tri.off, 0, (TRIBUCKETS + 1) * sizeof *tri.off);
+		memset(tri.last, 0, TRIBUCKETS * sizeof *tri.last);
+	}
+}
+
+/* When the input only grew since the last match, its matches are among
+ * the last ones plus the items read since. Returns how many items to test,
+ * narrowitem() maps them to indices and narrowend() records the result. */
+static size_t
+narrowbegin(void)
+{
+	if (candsz < items_sz &&
+	    !(cand = realloc(cand, (candsz = items_sz) * sizeof *cand)))
+		die("cannot realloc %u bytes:", candsz * sizeof *cand);
+	if (strncmp(qtext, candtext, strlen(candtext)))
+		ncand = candscanned = 0;
+	if (!fuzzy)
+		trinarrow();
+	return ncand + items_ln - candscanned;
+}
+
+static size_t
+narrowitem(size_t k)
+{
+	return k < ncand ? cand[k] : candscanned + k - ncand;
+}
+
+static void
+narrowend(size_t n)
+{
+	ncand = n;
+	candscanned = items_ln;
+	candguess = 0;
+	strcpy(candtext, qtext);
+}
+
+static void *
+poolworker(void *arg)
+{
+	unsigned long gen = 0;
+	size_t c;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.gen == gen)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		gen = pool.gen;
+		while (pool.next < pool.nchunks) {
+			c = pool.next++;
+			pthread_mutex_unlock(&pool.lock);
+			pool.fn(c);
+			pthread_mutex_lock(&pool.lock);
 		}
-		free(fuzzymatches);
+		if (--pool.busy == 0)
+			pthread_cond_signal(&pool.done);
 	}
-	curr = sel = matches;
-	calcoffsets();
+	return NULL;
 }
 
+/* starts the workers on first use, returns 0 if there are none */
+static int
+poolstart(void)
+{
+	static int started = 0;
+	long n;
+	int i;
+
+	if (started)
+		return pool.nthreads;
+	started = 1;
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) <= 1)
+		return 0;
+	pool.nthreads = MIN(n - 1, 63); /* the calling thread works too */
+	pool.threads = ecalloc(pool.nthreads, sizeof *pool.threads);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+	for (i = 0; i < pool.nthreads; i++)
+		if (pthread_create(&pool.threads[i], NULL, poolworker, NULL))
+			break;
+	return (pool.nthreads = i);
+}
+
+/* runs fn on chunks 0 to nchunks - 1 across the pool and the calling thread */
 static void
-match(void)
+poolrun(void (*fn)(size_t), size_t nchunks)
 {
-	if (fuzzy) {
-		fuzzymatch();
+	size_t c;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.next = 0;
+	pool.nchunks = nchunks;
+	pool.busy = pool.nthreads;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.work);
+	while (pool.next < pool.nchunks) {
+		c = pool.next++;
+		pthread_mutex_unlock(&pool.lock);
+		fn(c);
+		pthread_mutex_lock(&pool.lock);
+	}
+	while (pool.busy)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* whether a newer match than the one running was asked for */
+static int
+matchstale(void)
+{
+	int r;
+
+	pthread_mutex_lock(&matcher.lock);
+	r = matcher.gen != computegen;
+	pthread_mutex_unlock(&matcher.lock);
+	return r;
+}
+
+static void
+testchunk(size_t c)
+{
+	struct result *r = &results[c];
+	size_t k, n, end = MIN(nscan, (c + 1) * MATCHCHUNK);
+	int b;
+
+	r->n = 0;
+	if (matchstale())
 		return;
+	for (k = c * MATCHCHUNK; k < end; k++) {
+		n = narrowitem(k);
+		if ((qsig & ~hot.sig[n]) || (b = testitem(n)) < 0)
+			continue;
+		if (r->n == r->sz) {
+			r->sz = r->sz ? r->sz * 2 : 256;
+			if (!(r->v = realloc(r->v, r->sz * sizeof *r->v)) ||
+			    !(r->b = realloc(r->b, r->sz * sizeof *r->b)))
+				die("cannot realloc %u bytes:", r->sz * sizeof *r->v);
+		}
+		r->v[r->n] = n;
+		r->b[r->n++] = b;
+	}
+}
+
+/* Tests the items narrowbegin() selects with fn, split in chunks of
+ * MATCHCHUNK that run on the pool from parallelmin items on, and
+ * records the matches as the next candidates. The matches of chunk c
+ * are in results[c], in item order. Returns the number of chunks, or 0
+ * when a newer match made this one stale. */
+static size_t
+testitems(int (*fn)(size_t))
+{
+	size_t c, k, nchunks, ncandnew = 0;
+
+	testitem = fn;
+	nscan = narrowbegin();
+	nchunks = (nscan + MATCHCHUNK - 1) / MATCHCHUNK;
+	if (nchunks > resultssz) {
+		if (!(results = realloc(results, nchunks * sizeof *results)))
+			die("cannot realloc %u bytes:", nchunks * sizeof *results);
+		memset(&results[resultssz], 0, (nchunks - resultssz) * sizeof *results);
+		resultssz = nchunks;
+	}
+	if (nchunks > 1 && nscan >= parallelmin && poolstart())
+		poolrun(testchunk, nchunks);
+	else
+		for (c = 0; c < nchunks; c++)
+			testchunk(c);
+
+	if (matchstale()) {
+		if (candguess)
+			ncand = candscanned = candguess = 0;
+		return 0;
+	}
+	for (c = 0; c < nchunks; c++)
+		for (k = 0; k < results[c].n; k++)
+			cand[ncandnew++] = results[c].v[k];
+	narrowend(ncandnew);
+	return nchunks;
+}
+
+/* fuzzy matches are ordered by distance, then by input order */
+static int
+rankafter(const struct rank *a, const struct rank *b)
+{
+	if (a->d != b->d)
+		return a->d > b->d;
+	return a->n > b->n;
+}
+
+int
+compare_distance(const void *a, const void *b)
+{
+	return rankafter(a, b) ? 1 : -1;
+}
+
+/* restores the max-heap of n matches below h[i] */
+static void
+siftdown(struct rank *h, size_t n, size_t i)
+{
+	struct rank t;
+	size_t c;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && rankafter(&h[c + 1], &h[c]))
+			c++;
+		if (!rankafter(&h[c], &h[i]))
+			break;
+		t = h[i];
+		h[i] = h[c];
+		h[c] = t;
+	}
+}
+
+/* sorts the matches fuzzymatch() left out of the top */
+static void
+rankrest(void)
+{
+	if (shown.nranked == shown.n)
+		return;
+	qsort(&shown.v[shown.nranked], shown.n - shown.nranked, sizeof *shown.v, compare_distance);
+	shown.nranked = shown.n;
+}
+
+/* Sets up the needles for the len bytes of q: the bytes fstrncmp() takes
+ * for each, which are one or two for strncasecmp() in most locales. */
+static void
+fuzzyprepare(const char *q, int len, struct needle *needles)
+{
+	struct needle *nd;
+	int i, x;
+
+	for (i = 0; i < len; i++) {
+		nd = &needles[i];
+		nd->a = q[i];
+		nd->n = 1;
+		if (fstrncmp != strncasecmp)
+			continue;
+		for (x = 1; x < 256; x++) {
+			if (x == nd->a || tolower(x) != tolower(nd->a))
+				continue;
+			if (nd->n++ == 1)
+				nd->b = x;
+		}
+	}
+}
+
+/* Returns the first byte of s before end the needle matches, or NULL.
+ * A single byte is left to memchr(3); a pair is searched a word at a
+ * time, and anything else falls back to fstrncmp(). */
+static const char *
+findneedle(const char *s, const char *end, const struct needle *nd)
+{
+	uint64_t w, va, vb;
+	char c = nd->a;
+
+	if (nd->n == 1)
+		return memchr(s, nd->a, end - s);
+	if (nd->n == 2) {
+		va = ONES * nd->a;
+		vb = ONES * nd->b;
+		for (; end - s >= 8; s += 8) {
+			memcpy(&w, s, 8);
+			if (HASZERO(w ^ va) | HASZERO(w ^ vb))
+				break;
+		}
+		for (; s < end; s++)
+			if ((unsigned char)*s == nd->a || (unsigned char)*s == nd->b)
+				return s;
+		return NULL;
 	}
-	static char **tokv = NULL;
+	for (; s < end; s++)
+		if (!fstrncmp(&c, s, 1))
+			return s;
+	return NULL;
+}
+
+static int
+fuzzyitem(size_t n)
+{
+	const char *s = hot.text[n], *p, *end = s + hot.len[n];
+	int pidx, sidx = 0, eidx = 0; /* pointer, start of match, end of match */
+
+	if (!textlen)
+		return 0;
+	/* find each pattern byte after the previous one */
+	for (pidx = 0, p = s; pidx < textlen; pidx++, p++) {
+		if (!(p = findneedle(p, end, &needles[pidx])))
+			return -1;
+		if (!pidx)
+			sidx = p - s;
+		eidx = p - s;
+	}
+	/* compute distance */
+	/* add penalty if match starts late (log(sidx+2))
+	 * add penalty for long a match without many matching characters */
+	if (hot.flags[n] & ItemHp)
+		items[n].distance = 0;
+	else
+		items[n].distance = (uint64_t)RANKONE * (1 + eidx - sidx - textlen) +
+			(sidx < LENGTH(logtab) ? logtab[sidx] : (uint64_t)(RANKONE * log(sidx + 2) + 0.5));
+	return 0;
+}
+
+/* Ranks the fuzzy matches of qtext into computed, returns 0 if stale. */
+static int
+fuzzymatch(void)
+{
+	struct rank *v, t;
+	size_t c, k, i, j, m, n = 0, ntop, nchunks;
+
+	if (!logtab[0])
+		for (i = 0; i < LENGTH(logtab); i++)
+			logtab[i] = RANKONE * log(i + 2) + 0.5;
+	textlen = strlen(qtext);
+	qsig = textsig(qtext, textlen);
+	fuzzyprepare(qtext, textlen, needles);
+	nchunks = testitems(fuzzyitem);
+	if (matchstale())
+		return 0;
+
+	for (c = 0; c < nchunks; c++)
+		n += results[c].n;
+	if (n > computed.sz) {
+		if (!(computed.v = realloc(computed.v, n * sizeof *computed.v)))
+			die("cannot realloc %u bytes:", n * sizeof *computed.v);
+		computed.sz = n;
+	}
+	v = computed.v;
+	/* only a few pages are ever seen, so keep the best ntop matches in a
+	 * max-heap at the front and put the others at the back */
+	ntop = textlen ? MIN(n, MAX(RANKTOP, 4 * lines * columns)) : n;
+	for (i = 0, m = n, c = 0; c < nchunks; c++) {
+		for (k = 0; k < results[c].n; k++) {
+			t.n = results[c].v[k];
+			t.d = items[t.n].distance;
+			if (i < ntop) {
+				v[i++] = t;
+				if (textlen && i == ntop)
+					for (j = ntop / 2; j-- > 0;)
+						siftdown(v, ntop, j);
+			} else if (rankafter(&v[0], &t)) {
+				v[--m] = v[0];
+				v[0] = t;
+				siftdown(v, ntop, 0);
+			} else {
+				v[--m] = t;
+			}
+		}
+	}
+	/* sort the heap */
+	if (textlen)
+		for (i = ntop; i > 1;) {
+			t = v[--i];
+			v[i] = v[0];
+			v[0] = t;
+			siftdown(v, i, 0);
+		}
+	computed.n = n;
+	computed.nranked = ntop;
+	return 1;
+}
+
+static int
+tokenitem(size_t n)
+{
+	char *s = hot.text[n];
+	int i;
+
+	for (i = 0; i < tokc; i++)
+		if (!fstrstr(s, tokv[i]))
+			return -1; /* not all tokens match */
+	/* exact matches go first, then prefixes with high priority, then prefixes, then substrings */
+	if (!tokc || !fstrncmp(qtext, s, textlen + 1))
+		return 0;
+	else if ((hot.flags[n] & ItemHp) && !fstrncmp(tokv[0], s, tok0len))
+		return 1;
+	else if (!fstrncmp(tokv[0], s, tok0len))
+		return 2;
+	else
+		return 3;
+}
+
+/* Matches qtext into computed, returns 0 if a newer match made it stale.
+ * Runs on the matcher thread or, while that is idle, on the main one. */
+static int
+matchcompute(void)
+{
 	static int tokn = 0;
 
 	char buf[sizeof text], *s;
-	int i, tokc = 0;
-	size_t len, textsize;
-	struct item *item, *lhpprefix, *lprefix, *lsubstr, *hpprefixend, *prefixend, *substrend;
+	size_t c, k, n, nchunks;
+	int b, i;
 
+	if (fuzzy)
+		return fuzzymatch();
 	if (json)
 		fstrstr = strcasestr;
-	strcpy(buf, text);
+	strcpy(buf, qtext);
 	/* separate input text into tokens to be matched individually */
-	for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
+	for (tokc = 0, s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
 		if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
 			die("cannot realloc %u bytes:", tokn * sizeof *tokv);
-	len = tokc ? strlen(tokv[0]) : 0;
+	tok0len = tokc ? strlen(tokv[0]) : 0;
+	textlen = strlen(qtext);
+	for (qsig = 0, i = 0; i < tokc; i++)
+		qsig |= textsig(tokv[i], strlen(tokv[i]));
+	nchunks = testitems(tokenitem);
+	if (matchstale())
+		return 0;
+
+	for (n = 0, c = 0; c < nchunks; c++)
+		n += results[c].n;
+	if (n > computed.sz) {
+		if (!(computed.v = realloc(computed.v, n * sizeof *computed.v)))
+			die("cannot realloc %u bytes:", n * sizeof *computed.v);
+		computed.sz = n;
+	}
+	/* chain the buckets in order, each in item order */
+	computed.n = computed.nranked = 0;
+	for (b = 0; b < 4; b++)
+		for (c = 0; c < nchunks; c++)
+			for (k = 0; k < results[c].n; k++)
+				if (results[c].b[k] == b)
+					computed.v[computed.n++].n = results[c].v[k];
+	computed.nranked = computed.n;
+	return 1;
+}
+
+/* shows the matches computed last */
+static void
+matchshow(void)
+{
+	struct order t;
+	size_t i;
+
+	t = shown;
+	shown = computed;
+	computed = t;
+	showngen = matcher.donegen;
+	hl.len = strlen(qtext);
+	memcpy(hl.text, qtext, hl.len + 1);
+	hl.gen++;
+	if (fuzzy)
+		fuzzyprepare(hl.text, hl.len, hl.needles);
+	else
+		for (i = 0; i < hl.len; i++)
+			if (hl.text[i] == ' ')
+				hl.text[i] = '\0';
+	curr = sel = 0;
+	calcoffsets();
+}
+
+static int
+rangecmp(const void *a, const void *b)
+{
+	const struct range *ra = a, *rb = b;
+
+	return (ra->a > rb->a) - (ra->a < rb->a);
+}
+
+/* Finds where the shown matches matched item n as matching does: each
+ * text byte after the previous one, or the first occurrence of each
+ * token. Stores the byte ranges in hl.r, sorted and merged, and returns
+ * their number. */
+static size_t
+matchranges(size_t n)
+{
+	const char *s = hot.text[n], *p, *end = s + hot.len[n];
+	size_t i, k, nr = 0;
 
-	matches = lhpprefix = lprefix = lsubstr = matchend = hpprefixend = prefixend = substrend = NULL;
-	textsize = strlen(text) + 1;
-	for (item = items; item && item->text; item++) {
-		for (i = 0; i < tokc; i++)
-			if (!fstrstr(item->text, tokv[i]))
+	if (fuzzy) {
+		for (i = 0, p = s; i < hl.len; i++, p++) {
+			if (!(p = findneedle(p, end, &hl.needles[i])))
 				break;
-		if (i != tokc) /* not all tokens match */
+			if (nr && hl.r[nr - 1].b == (size_t)(p - s))
+				hl.r[nr - 1].b++;
+			else
+				hl.r[nr++] = (struct range){ p - s, p - s + 1 };
+		}
+		return nr;
+	}
+	for (i = 0; i < hl.len; i += k + 1) {
+		if (!(k = strlen(hl.text + i)))
 			continue;
-		/* exact matches go first, then prefixes with high priority, then prefixes, then substrings */
-		if (!tokc || !fstrncmp(text, item->text, textsize))
-			appenditem(item, &matches, &matchend);
-		else if (item->hp && !fstrncmp(tokv[0], item->text, len))
-			appenditem(item, &lhpprefix, &hpprefixend);
-		else if (!fstrncmp(tokv[0], item->text, len))
-			appenditem(item, &lprefix, &prefixend);
+		if ((p = fstrstr(s, hl.text + i)))
+			hl.r[nr++] = (struct range){ p - s, p - s + k };
+	}
+	qsort(hl.r, nr, sizeof *hl.r, rangecmp);
+	for (i = k = 0; i < nr; i++) {
+		if (k && hl.r[i].a <= hl.r[k - 1].b)
+			hl.r[k - 1].b = MAX(hl.r[k - 1].b, hl.r[i].b);
 		else
-			appenditem(item, &lsubstr, &substrend);
-	}
-	if (lhpprefix) {
-		if (matches) {
-			matchend->right = lhpprefix;
-			lhpprefix->left = matchend;
-		} else
-			matches = lhpprefix;
-		matchend = hpprefixend;
-	}
-	if (lprefix) {
-		if (matches) {
-			matchend->right = lprefix;
-			lprefix->left = matchend;
-		} else
-			matches = lprefix;
-		matchend = prefixend;
-	}
-	if (lsubstr) {
-		if (matches) {
-			matchend->right = lsubstr;
-			lsubstr->left = matchend;
-		} else
-			matches = lsubstr;
-		matchend = substrend;
-	}
-	curr = sel = matches;
-	calcoffsets();
+			hl.r[k++] = hl.r[i];
+	}
+	return k;
+}
+
+/* cancels what the matcher thread does or is about to and waits for it */
+static void
+matchstop(void)
+{
+	pthread_mutex_lock(&matcher.lock);
+	matcher.taken = ++matcher.gen;
+	while (matcher.busy)
+		pthread_cond_wait(&matcher.done, &matcher.lock);
+	pthread_mutex_unlock(&matcher.lock);
+}
+
+/* matches the text right away, stopping the matcher thread first */
+static void
+match(void)
+{
+	matchpending = 0;
+	matchstop();
+	/* not before, the stale job's matchstale() compares gen with it */
+	computegen = matcher.gen;
+
+	strcpy(qtext, text);
+	matchcompute();
+	matcher.donegen = computegen;
+	matchshow();
+}
+
+static void *
+matcherthread(void *arg)
+{
+	char c = 0;
+
+	pthread_mutex_lock(&matcher.lock);
+	for (;;) {
+		while (matcher.taken == matcher.gen)
+			pthread_cond_wait(&matcher.work, &matcher.lock);
+		computegen = matcher.taken = matcher.gen;
+		strcpy(qtext, matcher.text);
+		matcher.busy = 1;
+		pthread_mutex_unlock(&matcher.lock);
+		matchcompute();
+		pthread_mutex_lock(&matcher.lock);
+		matcher.busy = 0;
+		if (computegen == matcher.gen)
+			matcher.donegen = computegen;
+		pthread_cond_broadcast(&matcher.done);
+		if (write(matcher.fd[1], &c, 1) == -1 && errno != EAGAIN)
+			die("write:");
+	}
+	return NULL;
+}
+
+/* whether the matcher thread has a match running or about to */
+static int
+matchbusy(void)
+{
+	int r;
+
+	pthread_mutex_lock(&matcher.lock);
+	r = matcher.busy || matcher.taken != matcher.gen;
+	pthread_mutex_unlock(&matcher.lock);
+	return r;
+}
+
+/* Matches the text on the matcher thread from parallelmin items on, so
+ * that run() keeps handling events; matchready() shows the result. */
+static void
+matchstart(void)
+{
+	if (items_ln < parallelmin)
+		goto sync;
+	if (!matcher.started) {
+		if (pipe(matcher.fd) == -1 ||
+		    fcntl(matcher.fd[0], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(matcher.fd[1], F_SETFL, O_NONBLOCK) == -1 ||
+		    pthread_create(&matcher.thread, NULL, matcherthread, NULL))
+			goto sync;
+		matcher.started = 1;
+	}
+	matchpending = 0;
+	pthread_mutex_lock(&matcher.lock);
+	strcpy(matcher.text, text);
+	matcher.gen++;
+	pthread_cond_signal(&matcher.work);
+	pthread_mutex_unlock(&matcher.lock);
+	return;
+sync:
+	match();
+}
+
+/* shows the match the matcher thread finished, if it is the latest */
+static void
+matchready(void)
+{
+	char buf[64];
+	int ready;
+
+	while (read(matcher.fd[0], buf, sizeof buf) > 0)
+		;
+	pthread_mutex_lock(&matcher.lock);
+	ready = !matcher.busy && matcher.taken == matcher.gen &&
+	        matcher.donegen == matcher.gen && showngen != matcher.gen;
+	pthread_mutex_unlock(&matcher.lock);
+	if (ready) {
+		matchshow();
+		drawpending = 1;
+	}
 }
 
 static void
@@ -528,7 +1520,7 @@ insert(const char *str, ssize_t n)
 	if (n > 0)
 		memcpy(&text[cursor], str, n);
 	cursor += n;
-	match();
+	matchpending = 1;
 }
 
 static size_t
@@ -641,7 +1633,7 @@ navhistory(int dir)
 	strncpy(text, p, len);
 	text[len] = '\0';
 	cursor = len;
-	match();
+	matchpending = 1;
 }
 
 static void
@@ -681,6 +1673,20 @@ out:
 	free(history);
 }
 
+/* waits for the matches of the text before keys that act on them */
+static void
+flushmatch(void)
+{
+	if (matchpending)
+		matchstart();
+	pthread_mutex_lock(&matcher.lock);
+	while (matcher.busy || matcher.taken != matcher.gen)
+		pthread_cond_wait(&matcher.done, &matcher.lock);
+	pthread_mutex_unlock(&matcher.lock);
+	if (showngen != matcher.donegen)
+		matchshow();
+}
+
 static void
 keypress(XKeyEvent *ev)
 {
@@ -689,8 +1695,7 @@ keypress(XKeyEvent *ev)
 	KeySym ksym;
 	Status status;
 	int i;
-	struct item *tmpsel;
-	bool offscreen = false;
+	struct item *item;
 
 	len = XmbLookupString(xic, ev, buf, sizeof buf, &ksym, &status);
 	switch (status) {
@@ -723,7 +1728,7 @@ keypress(XKeyEvent *ev)
 
 		case XK_k: /* delete right */
 			text[cursor] = '\0';
-			match();
+			matchpending = 1;
 			break;
 		case XK_u: /* delete left */
 			insert(NULL, 0 - cursor);
@@ -740,22 +1745,29 @@ keypress(XKeyEvent *ev)
 			                  utf8, utf8, win, CurrentTime);
 			return;
 		case XK_r:
+			flushmatch();
 			if (histfile) {
 				if (!backup_items) {
 					backup_items = items;
-					items = calloc(histsz + 1, sizeof(struct item));
-					if (!items) {
-						die("cannot allocate memory");
-					}
-
-					for (i = 0; i < histsz; i++) {
-						items[i].text = history[i];
-					}
+					backup_hot = hot;
+					backup_sz = items_sz;
+					backup_ln = items_ln;
+					items = NULL;
+					memset(&hot, 0, sizeof hot);
+					items_sz = items_ln = 0;
+
+					for (i = 0; i < histsz; i++)
+						itemnew(history[i], strlen(history[i]));
 				} else {
-					free(items);
+					freeitems(items, &hot);
 					items = backup_items;
+					hot = backup_hot;
+					items_sz = backup_sz;
+					items_ln = backup_ln;
 					backup_items = NULL;
 				}
+				ncand = candscanned = 0; /* a different item set */
+				drawn.all = 1;
 			}
 			match();
 			goto draw;
@@ -767,19 +1779,22 @@ keypress(XKeyEvent *ev)
 			goto draw;
 		case XK_Return:
 		case XK_KP_Enter:
-			if (sel && issel(sel->id)) {
+			flushmatch();
+			if (!(item = selitem()))
+				break;
+			if (issel(item->id)) {
 				for (int i = 0;i < selidsize;i++)
-					if (selid[i] == sel->id)
+					if (selid[i] == item->id)
 						selid[i] = -1;
 			} else {
 				for (int i = 0;i < selidsize;i++)
 					if (selid[i] == -1) {
-						selid[i] = sel->id;
+						selid[i] = item->id;
 						return;
 					}
 				selidsize++;
 				selid = realloc(selid, (selidsize + 1) * sizeof(int));
-				selid[selidsize - 1] = sel->id;
+				selid[selidsize - 1] = item->id;
 			}
 			break;
 		case XK_bracketleft:
@@ -836,48 +1851,38 @@ insert:
 			cursor = strlen(text);
 			break;
 		}
-		if (next) {
-			/* jump to end of list and position items in reverse */
-			curr = matchend;
-			calcoffsets();
-			curr = prev;
-			calcoffsets();
-			while (next && (curr = curr->right))
-				calcoffsets();
-		}
-		sel = matchend;
+		flushmatch();
+		rankrest();
+		if (next < shown.n)
+			lastpage();
+		sel = shown.n ? shown.n - 1 : 0;
 		break;
 	case XK_Escape:
 		cleanup();
 		exit(1);
 	case XK_Home:
-		if (sel == matches) {
+		flushmatch();
+		if (sel == 0) {
 			cursor = 0;
 			break;
 		}
-		sel = curr = matches;
+		sel = curr = 0;
 		calcoffsets();
 		break;
 	case XK_Left:
+		flushmatch();
 		if (columns > 1) {
-			if (!sel)
+			/* a column to the left */
+			if (!shown.n || sel < (size_t)lines)
 				return;
-			tmpsel = sel;
-			for (i = 0; i < lines; i++) {
-				if (!tmpsel->left ||  tmpsel->left->right != tmpsel)
-					return;
-				if (tmpsel == curr)
-					offscreen = true;
-				tmpsel = tmpsel->left;
-			}
-			sel = tmpsel;
-			if (offscreen) {
+			sel -= lines;
+			if (sel < curr) {
 				curr = prev;
 				calcoffsets();
 			}
 			break;
 		}
-		if (cursor > 0 && (!sel || !sel->left || lines > 0)) {
+		if (cursor > 0 && (!shown.n || sel == 0 || lines > 0)) {
 			cursor = nextrune(-1);
 			break;
 		}
@@ -885,196 +1890,690 @@ insert:
 			return;
 		/* fallthrough */
 	case XK_Up:
-		if (sel && sel->left && (sel = sel->left)->right == curr) {
+		flushmatch();
+		if (shown.n && sel > 0 && sel-- == curr) {
 			curr = prev;
 			calcoffsets();
 		}
 		break;
 	case XK_Next:
-		if (!next)
+		flushmatch();
+		if (next == shown.n)
 			return;
 		sel = curr = next;
 		calcoffsets();
 		break;
 	case XK_Prior:
-		if (!prev)
+		flushmatch();
+		if (!shown.n)
 			return;
 		sel = curr = prev;
 		calcoffsets();
 		break;
 	case XK_Return:
 	case XK_KP_Enter:
-		if (sel && sel->json) {
-			if (json_is_object(sel->json)) {
-				listjson(sel->json);
+		flushmatch();
+		item = selitem();
+		if (item && item->json) {
+			if (json_is_object(item->json)) {
+				listjson(item->json);
 				text[0] = '\0';
 				match();
-				drawmenu();
 				break;
 			} else {
-				puts(json_string_value(sel->json));
+				puts(json_string_value(item->json));
 			}
 		}
 		if (!(ev->state & ControlMask)) {
 			for (int i = 0;i < selidsize;i++)
-				if (selid[i] != -1 && (!sel || sel->id != selid[i]))
+				if (selid[i] != -1 && (!item || item->id != selid[i]))
 					puts(items[selid[i]].text);
-			if (sel && !(ev->state & ShiftMask))
-				puts(sel->text);
+			if (item && !(ev->state & ShiftMask))
+				puts(item->text);
 			else
 				puts(text);
 
-			savehistory((sel && !(ev->state & ShiftMask))
-				    ? sel->text : text);
+			savehistory((item && !(ev->state & ShiftMask))
+				    ? item->text : text);
 			cleanup();
 			exit(0);
 		}
 		break;
 	case XK_Right:
+		flushmatch();
 		if (columns > 1) {
-			if (!sel)
+			/* a column to the right */
+			if (!shown.n || sel + lines >= shown.n)
 				return;
-			tmpsel = sel;
-			for (i = 0; i < lines; i++) {
-				if (!tmpsel->right ||  tmpsel->right->left != tmpsel)
-					return;
-				tmpsel = tmpsel->right;
-				if (tmpsel == next)
-					offscreen = true;
-			}
-			sel = tmpsel;
-			if (offscreen) {
+			sel += lines;
+			if (sel >= next) {
 				curr = next;
 				calcoffsets();
 			}
 			break;
 		}
-		if (text[cursor] != '\0') {
-			cursor = nextrune(+1);
-			break;
+		if (text[cursor] != '\0') {
+			cursor = nextrune(+1);
+			break;
+		}
+		if (lines > 0)
+			return;
+		/* fallthrough */
+	case XK_Down:
+		flushmatch();
+		if (sel + 1 < shown.n && ++sel == next) {
+			curr = next;
+			calcoffsets();
+		}
+		break;
+	case XK_Tab:
+		flushmatch();
+		if (!(item = selitem()))
+			return;
+		strncpy(text, item->text, sizeof text - 1);
+		text[sizeof text - 1] = '\0';
+		cursor = strlen(text);
+		matchpending = 1;
+		break;
+	}
+
+draw:
+	drawpending = 1;
+}
+
+static void
+paste(void)
+{
+	char *p, *q;
+	int di;
+	unsigned long dl;
+	Atom da;
+
+	/* we have been given the current selection, now insert it into input */
+	if (XGetWindowProperty(dpy, win, utf8, 0, (sizeof text / 4) + 1, False,
+	                   utf8, &da, &di, &dl, &dl, (unsigned char **)&p)
+	    == Success && p) {
+		insert(p, (q = strchr(p, '\n')) ? q - p : (ssize_t)strlen(p));
+		XFree(p);
+	}
+	drawpending = 1;
+}
+
+static void
+readjson(const char *path)
+{
+	json_error_t jerr;
+
+	if (!(json = json_load_file(path, 0, &jerr)))
+		die("%s @ line: %i - %s", jerr.text, jerr.line, path);
+}
+
+static void
+listjson(json_t *obj)
+{
+	void *iter;
+	struct item *item;
+
+	items_ln = 0;
+	widest = ilongest = measured = 0;
+	ncand = candscanned = 0;
+	drawn.all = 1;
+	indexreset();
+	iter = json_object_iter(obj);
+	while (iter) {
+		item = itemnew((char*) json_object_iter_key(iter),
+		               strlen(json_object_iter_key(iter)));
+		item->json = json_object_iter_value(iter);
+		if (hot.len[items_ln - 1] > hot.len[ilongest])
+			ilongest = items_ln - 1;
+		iter = json_object_iter_next(obj, iter);
+	}
+	estimatewidth();
+	inputw = widest;
+	lines = MIN(lines, items_ln - 1);
+}
+
+static void
+additem(char *s, size_t len)
+{
+	itemnew(s, len);
+	if (ishp(s, len))
+		hot.flags[items_ln - 1] |= ItemHp;
+	if (len > hot.len[ilongest])
+		ilongest = items_ln - 1;
+}
+
+/* A fast hash of n bytes, continuing from h. */
+static uint64_t
+datahash(const char *p, size_t n, uint64_t h)
+{
+	uint64_t w;
+
+	for (; n >= 8; p += 8, n -= 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+	for (w = 0; n--;)
+		w = w << 8 | (unsigned char)p[n];
+	h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+	return h ^ h >> 32;
+}
+
+/* Names the cache snapshot of the n bytes of input at p: a hash of them
+ * and of what processing them depends on. The widths depend on every font
+ * of the set as fontconfig resolved it, file, size and DPI included. */
+static uint64_t
+inputkey(const char *p, size_t n)
+{
+	uint64_t h = datahash(p, n, n);
+	const char *opts[] = {
+		fstrncmp == strncasecmp ? "-i" : "", setlocale(LC_CTYPE, NULL)
+	};
+	FcChar8 *name;
+	Fnt *f;
+	int i;
+
+	for (i = 0; i < LENGTH(opts); i++)
+		h = datahash(opts[i], strlen(opts[i]) + 1, h);
+	for (i = 0; i < hplength; i++)
+		h = datahash(hpitems[i], strlen(hpitems[i]) + 1, h);
+	for (f = drw->fonts; f; f = f->next)
+		if ((name = FcNameUnparse(f->xfont->pattern))) {
+			h = datahash((char *)name, strlen((char *)name) + 1, h);
+			free(name);
+		}
+	return h;
+}
+
+static const char *
+cachepath(uint64_t key)
+{
+	static char path[PATH_MAX];
+
+	snprintf(path, sizeof path, "%s/%016llx", cachedir, (unsigned long long)key);
+	return path;
+}
+
+/* Takes the items from the snapshot of the input named key when there is
+ * one, returns 0 otherwise. A snapshot is the header, then per item the
+ * signature, text offset, length, width and flags, then the texts. */
+static int
+cacheload(uint64_t key)
+{
+	struct stat st;
+	const uint64_t *sig, *off;
+	const unsigned int *len, *w;
+	const unsigned char *flags;
+	char *text;
+	size_t i, n;
+	int fd;
+
+	cachekey = key;
+	cachewanted = 1;
+	if ((fd = open(cachepath(key), O_RDONLY)) == -1)
+		return 0;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof *cache ||
+	    (cache = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		cache = NULL;
+		close(fd);
+		return 0;
+	}
+	futimens(fd, NULL); /* used last, for cacheprune() */
+	close(fd);
+	cachesz = st.st_size;
+	n = cache->n;
+	if (memcmp(cache->magic, "dmenu\0\0\1", 8) || cache->key != key || n >= cachesz ||
+	    sizeof *cache + n * (2 * sizeof *sig + 2 * sizeof *len + 1) + cache->textsz != cachesz)
+		goto stale;
+	sig = (const uint64_t *)(cache + 1);
+	off = sig + n;
+	len = (const unsigned int *)(off + n);
+	w = len + n;
+	flags = (const unsigned char *)(w + n);
+	text = (char *)(flags + n);
+	for (i = 0; i < n; i++)
+		if (off[i] + len[i] >= cache->textsz || text[off[i] + len[i]])
+			goto stale;
+
+	itemsgrow(n);
+	for (i = 0; i < n; i++) {
+		hot.text[i] = items[i].text = text + off[i];
+		items[i].json = NULL;
+		items[i].out = 0;
+		items[i].w = w[i];
+		items[i].id = i;
+	}
+	memcpy(hot.len, len, n * sizeof *len);
+	memcpy(hot.flags, flags, n);
+	memcpy(hot.sig, sig, n * sizeof *sig);
+	items_ln = measured = n;
+	widest = cache->widest;
+	ilongest = cache->ilongest;
+	cachewanted = 0;
+	return 1;
+stale:
+	munmap(cache, cachesz);
+	cache = NULL;
+	return 0;
+}
+
+/* a snapshot in cachedir and when it was last used */
+struct snap {
+	uint64_t key;
+	struct timespec used;
+};
+
+static int
+snapcmp(const void *a, const void *b)
+{
+	const struct timespec *x = &((const struct snap *)a)->used;
+	const struct timespec *y = &((const struct snap *)b)->used;
+
+	if (x->tv_sec != y->tv_sec)
+		return x->tv_sec < y->tv_sec ? 1 : -1;
+	return (x->tv_nsec < y->tv_nsec) - (x->tv_nsec > y->tv_nsec);
+}
+
+/* removes the snapshots in cachedir beyond the cachemax used last, and
+ * temporary files a killed dmenu left behind */
+static void
+cacheprune(void)
+{
+	struct dirent *d;
+	struct stat st;
+	struct snap *v = NULL;
+	size_t n = 0, sz = 0, i;
+	time_t now = time(NULL);
+	DIR *dir;
+
+	if (!(dir = opendir(cachedir)))
+		return;
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, ".tmp", 4)) {
+			/* old enough that no cachesave() is still writing it */
+			if (!fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) &&
+			    now - st.st_mtime > 300)
+				unlinkat(dirfd(dir), d->d_name, 0);
+			continue;
+		}
+		if (strlen(d->d_name) != 16 || strspn(d->d_name, "0123456789abcdef") != 16 ||
+		    fstatat(dirfd(dir), d->d_name, &st, 0) == -1)
+			continue;
+		if (n == sz) {
+			sz = sz ? sz * 2 : 64;
+			if (!(v = realloc(v, sz * sizeof *v)))
+				die("cannot realloc %u bytes:", sz * sizeof *v);
+		}
+		v[n].key = strtoull(d->d_name, NULL, 16);
+		v[n++].used = st.st_mtim;
+	}
+	if (n > cachemax) {
+		qsort(v, n, sizeof *v, snapcmp);
+		for (i = cachemax; i < n; i++)
+			unlink(cachepath(v[i].key));
+	}
+	closedir(dir);
+	free(v);
+}
+
+/* writes the snapshot cacheload() takes, once the items are measured */
+static void
+cachesave(void)
+{
+	struct cachehdr h = { .magic = "dmenu\0\0\1" };
+	char tmp[PATH_MAX];
+	uint64_t o;
+	unsigned int w;
+	size_t i;
+	FILE *fp;
+	int fd;
+
+	cachewanted = 0;
+	mkdir(cachedir, 0700);
+	snprintf(tmp, sizeof tmp, "%s/.tmpXXXXXX", cachedir);
+	if ((fd = mkstemp(tmp)) == -1)
+		return;
+	if (!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	h.key = cachekey;
+	h.n = items_ln;
+	for (i = 0; i < items_ln; i++)
+		h.textsz += hot.len[i] + 1;
+	h.widest = widest;
+	h.ilongest = ilongest;
+	fwrite(&h, sizeof h, 1, fp);
+	fwrite(hot.sig, sizeof *hot.sig, items_ln, fp);
+	for (i = 0, o = 0; i < items_ln; o += hot.len[i++] + 1)
+		fwrite(&o, sizeof o, 1, fp);
+	fwrite(hot.len, sizeof *hot.len, items_ln, fp);
+	for (i = 0; i < items_ln; i++) {
+		w = items[i].w;
+		fwrite(&w, sizeof w, 1, fp);
+	}
+	fwrite(hot.flags, 1, items_ln, fp);
+	for (i = 0; i < items_ln; i++)
+		fwrite(hot.text[i], 1, hot.len[i] + 1, fp);
+	if (fclose(fp) == EOF || rename(tmp, cachepath(cachekey)) == -1)
+		unlink(tmp);
+	else
+		cacheprune();
+}
+
+static int
+mapstdin(void)
+{
+	struct stat st;
+	off_t off;
+	char *p, *q, *end;
+	size_t len;
+
+	if (fstat(STDIN_FILENO, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (off = lseek(STDIN_FILENO, 0, SEEK_CUR)) == -1 || off >= st.st_size)
+		return 0;
+	/* a private mapping lets newlines be replaced by NULs in place */
+	if ((map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	                STDIN_FILENO, 0)) == MAP_FAILED) {
+		map = NULL;
+		return 0;
+	}
+	mapsz = st.st_size;
+	if (cachedir && cacheload(inputkey(map + off, mapsz - off))) {
+		munmap(map, mapsz);
+		map = NULL;
+		return 1;
+	}
+
+	/* items point into the mapping, lines are split with memchr(3);
+	 * like the text, an item length stops at a NUL in the line */
+	for (p = map + off, end = map + mapsz; p < end; p = q + 1) {
+		if (!(q = memchr(p, '\n', end - p))) {
+			/* the bytes past the end of the file are zero up to the
+			 * page boundary; a file filling its last page has none */
+			len = strnlen(p, end - p);
+			if (mapsz % sysconf(_SC_PAGESIZE))
+				additem(p, len);
+			else
+				additem(arenadup(p, len), len);
+			break;
+		}
+		*q = '\0';
+		additem(p, strnlen(p, q - p));
+	}
+	return 1;
+}
+
+static void
+readstdin(void)
+{
+	char buf[sizeof text], *all = NULL, *p, *q;
+	size_t len, sz = 0;
+	ssize_t n;
+
+  if(passwd){
+    inputw = lines = 0;
+    return;
+  }
+
+	if (mapstdin()) {
+		stream = 0;
+	} else if (stream) {
+		/* items are read from run() once the menu is mapped */
+		if ((stdinflags = fcntl(STDIN_FILENO, F_GETFL)) == -1 ||
+		    fcntl(STDIN_FILENO, F_SETFL, stdinflags | O_NONBLOCK) == -1)
+			die("fcntl:");
+		return;
+	} else if (cachedir) {
+		/* the whole input names its snapshot */
+		for (len = 0;; len += n) {
+			if (len + BUFSIZ > sz && !(all = realloc(all, (sz = 2 * sz + BUFSIZ))))
+				die("cannot realloc %u bytes:", sz);
+			if ((n = read(STDIN_FILENO, all + len, sz - len)) == 0)
+				break;
+			if (n == -1 && errno != EINTR)
+				die("read:");
+			n = MAX(n, 0);
 		}
-		if (lines > 0)
-			return;
-		/* fallthrough */
-	case XK_Down:
-		if (sel && sel->right && (sel = sel->right) == next) {
-			curr = next;
-			calcoffsets();
+		if (!cacheload(inputkey(all, len)))
+			for (p = all; p < all + len; p = q + 1) {
+				if (!(q = memchr(p, '\n', all + len - p)))
+					q = all + len;
+				n = strnlen(p, q - p);
+				additem(arenadup(p, n), n);
+			}
+		free(all);
+	} else {
+		/* read each line from stdin and add it to the item list */
+		while (fgets(buf, sizeof buf, stdin)) {
+			len = strlen(buf);
+			if (len && buf[len - 1] == '\n')
+				buf[--len] = '\0';
+			additem(arenadup(buf, len), len);
 		}
-		break;
-	case XK_Tab:
-		if (!sel)
-			return;
-		strncpy(text, sel->text, sizeof text - 1);
-		text[sizeof text - 1] = '\0';
-		cursor = strlen(text);
-		match();
-		break;
 	}
+	estimatewidth();
+	inputw = widest;
+	lines = MIN(lines, items_ln);
+}
 
-draw:
-	drawmenu();
+static long
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L + now.tv_nsec - start->tv_nsec;
 }
 
 static void
-paste(void)
+readstream(void)
 {
+	struct timespec start;
 	char *p, *q;
-	int di;
-	unsigned long dl;
-	Atom da;
+	ssize_t n, selidx = -1;
+	size_t k, oldln = items_ln;
+
+	/* matching anew reorders the matches, so remember the selected item */
+	if (sel > 0 && sel < shown.n)
+		selidx = shown.v[sel].n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (sbuflen + BUFSIZ + 1 > sbufsz &&
+		    !(sbuf = realloc(sbuf, (sbufsz += BUFSIZ * 16))))
+			die("cannot realloc %u bytes:", sbufsz);
+		if ((n = read(STDIN_FILENO, sbuf + sbuflen, sbufsz - sbuflen - 1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			die("read:");
+		}
+		if (n == 0) { /* EOF; a last line may lack its newline */
+			if (sbuflen) {
+				n = strnlen(sbuf, sbuflen);
+				additem(arenadup(sbuf, n), n);
+			}
+			free(sbuf);
+			sbuf = NULL;
+			sbuflen = sbufsz = 0;
+			stream = 0;
+			break;
+		}
+		sbuflen += n;
+		for (p = sbuf; (q = memchr(p, '\n', sbuf + sbuflen - p)); p = q + 1) {
+			n = strnlen(p, q - p);
+			additem(arenadup(p, n), n);
+		}
+		memmove(sbuf, p, sbuflen -= p - sbuf);
+	} while (elapsed(&start) < STREAMBUDGET);
 
-	/* we have been given the current selection, now insert it into input */
-	if (XGetWindowProperty(dpy, win, utf8, 0, (sizeof text / 4) + 1, False,
-	                   utf8, &da, &di, &dl, &dl, (unsigned char **)&p)
-	    == Success && p) {
-		insert(p, (q = strchr(p, '\n')) ? q - p : (ssize_t)strlen(p));
-		XFree(p);
+	if (items_ln == oldln)
+		return;
+	estimatewidth();
+	updatewidth();
+
+	match();
+	if (selidx >= 0) {
+		/* keep the selection where the user put it, paging to it */
+		for (k = 0; k < shown.n && shown.v[k].n != (size_t)selidx; k++)
+			;
+		if (k >= shown.nranked && k < shown.n) {
+			rankrest();
+			for (k = shown.nranked; k-- > 0 && shown.v[k].n != (size_t)selidx;)
+				;
+		}
+		if (k < shown.n) {
+			sel = k;
+			while (sel >= next) {
+				curr = next;
+				calcoffsets();
+			}
+		}
 	}
 	drawmenu();
 }
 
 static void
-readjson(const char *path)
+measureitems(void)
 {
-	json_error_t jerr;
-
-	if (!(json = json_load_file(path, 0, &jerr)))
-		die("%s @ line: %i - %s", jerr.text, jerr.line, path);
+	struct timespec start;
+	unsigned int oldwidest = widest;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		widest = MAX(widest, itemw(&items[measured]));
+	} while (++measured < items_ln && (measured % 64 || elapsed(&start) < IDLEBUDGET));
+	if (cachewanted && measured == items_ln)
+		cachesave();
+
+	if (widest != oldwidest) {
+		updatewidth();
+		calcoffsets();
+		drawmenu();
+	}
 }
 
 static void
-listjson(json_t *obj)
+indexitem(size_t id)
 {
-	void *iter;
-	unsigned imax = 0;
-	unsigned tmpmax = 0;
-	struct item *item;
+	const unsigned char *s = (const unsigned char *)hot.text[id];
+	size_t i, len = hot.len[id];
+	uint32_t key = 0, b, d, v = id + 1;
 
-	items_ln = 0;
-	iter = json_object_iter(obj);
-	while (iter) {
-		item = itemnew();
-		item->text = (char*) json_object_iter_key(iter);
-		item->json = json_object_iter_value(iter);
-		item->out = 0;
-		drw_font_getexts(drw->fonts, item->text, strlen(item->text),
-				 &tmpmax, NULL);
-		if (tmpmax > inputw) {
-			inputw = tmpmax;
-			imax = items_ln - 1;
+	for (i = 0; i < len; i++) {
+		key = (key << 8 | tolower(s[i])) & 0xffffff;
+		if (i < 2)
+			continue;
+		b = key * 2654435761U >> (32 - TRIBITS);
+		if (tri.last[b] == v)
+			continue;
+		d = v - tri.last[b];
+		tri.last[b] = v;
+		if (tri.pass == 0) {
+			for (tri.off[b + 1]++; d >>= 7; tri.off[b + 1]++)
+				;
+		} else {
+			for (; d >= 128; d >>= 7)
+				tri.data[tri.fill[b]++] = d | 128;
+			tri.data[tri.fill[b]++] = d;
 		}
-		iter = json_object_iter_next(obj, iter);
 	}
-	if (items)
-		items[items_ln].text = NULL;
-	inputw = items ? TEXTW(items[imax].text) : 0;
-	lines = MIN(lines, items_ln - 1);
 }
 
+/* whether indexitems() has work left */
+static int
+indexwanted(void)
+{
+	return !fuzzy && indexmin && items_ln >= indexmin && !stream && tri.pass != 2;
+}
+
+/* Builds the trigram index a slice at a time like measureitems(), in two
+ * passes so that each bucket gets the exact size of its varints. */
 static void
-readstdin(void)
+indexitems(void)
 {
-	char buf[sizeof text], *p;
-	size_t i, size = 0;
-	unsigned int imax = 0;
-	unsigned int tmpmax = 0;
-	struct item *item;
+	struct timespec start;
+	size_t b;
 
-  if(passwd){
-    inputw = lines = 0;
-    return;
-  }
+	if (!tri.off) {
+		tri.off = ecalloc(TRIBUCKETS + 1, sizeof *tri.off);
+		tri.fill = ecalloc(TRIBUCKETS, sizeof *tri.fill);
+		tri.last = ecalloc(TRIBUCKETS, sizeof *tri.last);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		indexitem(tri.n);
+	} while (++tri.n < items_ln && (tri.n % 1024 || elapsed(&start) < IDLEBUDGET));
+	if (tri.n < items_ln)
+		return;
 
-	/* read each line from stdin and add it to the item list */
-	for (i = 0; fgets(buf, sizeof buf, stdin); i++) {
-		item = itemnew();
-		if ((p = strchr(buf, '\n')))
-			*p = '\0';
-		if (!(item->text = strdup(buf)))
-			die("cannot strdup %u bytes:", strlen(buf) + 1);
-		item->json = NULL;
-		// item->out = 0;
-		items[i].id = i; /* for multiselect */
-		items[i].hp = arrayhas(hpitems, hplength, items[i].text);
-		drw_font_getexts(drw->fonts, buf, strlen(buf), &tmpmax, NULL);
-		if (tmpmax > inputw) {
-			inputw = tmpmax;
-			imax = items_ln - 1;
-		}
+	if (tri.pass == 0) {
+		for (b = 0; b < TRIBUCKETS; b++)
+			tri.off[b + 1] += tri.off[b];
+		if (!(tri.data = realloc(tri.data, tri.off[TRIBUCKETS] + 1)))
+			die("cannot realloc %u bytes:", tri.off[TRIBUCKETS] + 1);
+		memcpy(tri.fill, tri.off, TRIBUCKETS * sizeof *tri.fill);
+		memset(tri.last, 0, TRIBUCKETS * sizeof *tri.last);
+		tri.n = 0;
 	}
-	if (items)
-		items[items_ln].text = NULL;
-	inputw = items ? TEXTW(items[imax].text) : 0;
-	lines = MIN(lines, items_ln);
+	tri.pass++;
 }
 
 static void
 run(void)
 {
 	XEvent ev;
+	fd_set fds;
+	struct timeval tv;
+	int xfd = ConnectionNumber(dpy), r, readin, idle, busy;
 
-	while (!XNextEvent(dpy, &ev)) {
+	for (;;) {
+		/* queued events are all handled before matching and
+		 * drawing once for them */
+		if ((matchpending || drawpending) && !XPending(dpy)) {
+			if (matchpending)
+				matchstart();
+			drawmenu();
+		}
+		/* stdin is read and items are measured while X is quiet,
+		 * but not while history items are shown or a match runs */
+		busy = matcher.started && matchbusy();
+		readin = stream && !backup_items && !busy;
+		idle = !backup_items && !busy && (measured < items_ln || indexwanted());
+		if ((readin || idle || matcher.started) && !XPending(dpy)) {
+			FD_ZERO(&fds);
+			FD_SET(xfd, &fds);
+			if (readin)
+				FD_SET(STDIN_FILENO, &fds);
+			if (matcher.started)
+				FD_SET(matcher.fd[0], &fds);
+			/* poll when idle, turn the spinner while matching */
+			tv.tv_sec = 0;
+			tv.tv_usec = busy ? 100000 : 0;
+			if ((r = select(MAX(MAX(xfd, STDIN_FILENO), matcher.fd[0]) + 1, &fds,
+			                NULL, NULL, idle || busy ? &tv : NULL)) == -1) {
+				if (errno == EINTR)
+					continue;
+				die("select:");
+			}
+			if (matcher.started && FD_ISSET(matcher.fd[0], &fds))
+				matchready();
+			else if (readin && FD_ISSET(STDIN_FILENO, &fds))
+				readstream();
+			else if (!r && busy)
+				drawpending = 1;
+			else if (!r && measured < items_ln)
+				measureitems();
+			else if (!r)
+				indexitems();
+			continue;
+		}
+		if (XNextEvent(dpy, &ev))
+			break;
 		if (XFilterEvent(&ev, win))
 			continue;
 		switch(ev.type) {
@@ -1110,30 +2609,17 @@ run(void)
 static void
 setup(void)
 {
-	int x, y, i, j;
+	int x, y, i;
 	unsigned int du;
 	XSetWindowAttributes swa;
-	XIM xim;
 	Window w, dw, *dws;
 	XWindowAttributes wa;
 	XClassHint ch = {"dmenu", "dmenu"};
 #ifdef XINERAMA
 	XineramaScreenInfo *info;
 	Window pw;
-	int a, di, n, area = 0;
+	int a, di, j, n, area = 0;
 #endif
-	/* init appearance */
-	for (j = 0; j < SchemeLast; j++) {
-		scheme[j] = drw_scm_create(drw, (const char**)colors[j], 2);
-	}
-	// for (j = 0; j < 5; ++j) {
-	// 	for (i = 0; i < 2; ++i)
-	// 		free(colors[j][i]);
-	// }
-
-	clip = XInternAtom(dpy, "CLIPBOARD",   False);
-	utf8 = XInternAtom(dpy, "UTF8_STRING", False);
-
 	/* calculate menu geometry */
 	bh = drw->fonts->h + 2;
 	bh = MAX(bh,lineheight);	/* make a menu line AT LEAST 'lineheight' tall */
@@ -1167,9 +2653,11 @@ setup(void)
 					break;
 
 		if (centered) {
-			mw = MIN(MAX(max_textw() + promptw, min_width), info[i].width);
-			x = info[i].x_org + ((info[i].width  - mw) / 2);
-			y = info[i].y_org + ((info[i].height - mh) / 2);
+			areax = info[i].x_org;
+			areay = info[i].y_org;
+			areaw = info[i].width;
+			areah = info[i].height;
+			centergeom(&x, &y);
 		} else {
 			x = info[i].x_org;
 			y = info[i].y_org + (topbar ? 0 : info[i].height - mh);
@@ -1185,9 +2673,10 @@ setup(void)
 			    parentwin);
 
 		if (centered) {
-			mw = MIN(MAX(max_textw() + promptw, min_width), wa.width);
-			x = (wa.width  - mw) / 2;
-			y = (wa.height - mh) / 2;
+			areax = areay = 0;
+			areaw = wa.width;
+			areah = wa.height;
+			centergeom(&x, &y);
 		} else {
 			x = 0;
 			y = topbar ? 0 : wa.height - mh;
@@ -1210,9 +2699,6 @@ setup(void)
 
 
 	/* input methods */
-	if ((xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
-		die("XOpenIM failed: could not open input device");
-
 	xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
 	                XNClientWindow, win, XNFocusWindow, win, NULL);
 
@@ -1233,10 +2719,11 @@ setup(void)
 static void
 usage(void)
 {
-	fputs("usage: dmenu [-bfivP] [-j json-file] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
+	fputs("usage: dmenu [-bfisvP] [-j json-file] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
 	      "             [-nb color] [-nf color] [-sb color] [-sf color] [-h height]\n"
-	      "             [-hb color] [-hf color] [-hp items] [-H histfile]\n"
-	      "             [-nhb color] [-nhf color] [-shb color] [-shf color] [-w windowid]\n", stderr);
+	      "             [-hb color] [-hf color] [-hp items] [-H histfile] [-C cachedir]\n"
+	      "             [-nhb color] [-nhf color] [-shb color] [-shf color] [-w windowid]\n"
+	      "       dmenu -daemon\n", stderr);
 	exit(1);
 }
 
@@ -1309,12 +2796,429 @@ readxresources(void) {
 	}
 }
 
+/* Connects to X and loads the fonts and colors, the first time; called
+ * again once a daemon's spare menu has its options, reloads those these
+ * change. */
+static void
+xinit(void)
+{
+	int i, recolor = !scheme[0];
+
+	if (!dpy) {
+		if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
+			fputs("warning: no locale support\n", stderr);
+		if (!(dpy = XOpenDisplay(NULL)))
+			die("cannot open display");
+		screen = DefaultScreen(dpy);
+		root = RootWindow(dpy, screen);
+		drw = drw_create(dpy, screen, root, DisplayWidth(dpy, screen),
+		                 DisplayHeight(dpy, screen));
+		readxresources();
+		clip = XInternAtom(dpy, "CLIPBOARD",   False);
+		utf8 = XInternAtom(dpy, "UTF8_STRING", False);
+		if ((xim = XOpenIM(dpy, NULL, NULL, NULL)) == NULL)
+			die("XOpenIM failed: could not open input device");
+	}
+	/* Now we check whether to override xresources with commandline parameters */
+	if ( tempfonts )
+	   fonts[0] = strdup(tempfonts);
+	if ( colortemp[0])
+	   colors[SchemeNorm][ColBg] = strdup(colortemp[0]);
+	if ( colortemp[1])
+	   colors[SchemeNorm][ColFg] = strdup(colortemp[1]);
+	if ( colortemp[2])
+	   colors[SchemeSel][ColBg]  = strdup(colortemp[2]);
+	if ( colortemp[3])
+	   colors[SchemeSel][ColFg]  = strdup(colortemp[3]);
+	if ( colortemp[4])
+	   colors[SchemeHp][ColBg] = strdup(colortemp[4]);
+	if ( colortemp[5])
+	   colors[SchemeHp][ColFg]  = strdup(colortemp[5]);
+	if ( colortemp[6])
+	   colors[SchemeNormHighlight][ColBg]  = strdup(colortemp[6]);
+	if ( colortemp[7])
+	   colors[SchemeNormHighlight][ColFg] = strdup(colortemp[7]);
+	if ( colortemp[8])
+	   colors[SchemeSelHighlight][ColBg]  = strdup(colortemp[8]);
+	if ( colortemp[9])
+	   colors[SchemeSelHighlight][ColFg]  = strdup(colortemp[9]);
+	for (i = 0; i < LENGTH(colortemp); i++)
+		recolor = recolor || colortemp[i];
+	if (!drw->fonts || tempfonts) {
+		drw_fontset_free(drw->fonts);
+		if (!drw_fontset_create(drw, (const char**)fonts, LENGTH(fonts)))
+			die("no fonts could be loaded.");
+	}
+	lrpad = drw->fonts->h;
+	/* init appearance */
+	for (i = 0; recolor && i < SchemeLast; i++)
+		scheme[i] = drw_scm_create(drw, (const char**)colors[i], 2);
+}
+
+/* Path of the socket a daemon for the display listens on, NULL if there
+ * is no XDG_RUNTIME_DIR or DISPLAY to name it after. */
+static const char *
+sockpath(void)
+{
+	static char path[sizeof ((struct sockaddr_un *)0)->sun_path];
+	const char *dir = getenv("XDG_RUNTIME_DIR"), *disp = getenv("DISPLAY");
+
+	if (!dir || !*dir || !disp || !*disp ||
+	    snprintf(path, sizeof path, "%s/dmenu-%s.sock", dir, disp) >= (int)sizeof path)
+		return NULL;
+	return path;
+}
+
+static int
+sockconnect(const char *path)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	int fd;
+
+	strcpy(sa.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+readall(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		if ((n = read(fd, buf, len)) == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+writeall(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, buf, len)) == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -1;
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* sends the len bytes of buf, passing the n descriptors of fds along */
+static int
+sendfds(int sock, const void *buf, size_t len, const int *fds, int n)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} cm;
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *c;
+
+	memset(&cm, 0, sizeof cm);
+	msg.msg_control = cm.buf;
+	msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(c), fds, n * sizeof(int));
+	if (sendmsg(sock, &msg, 0) != (ssize_t)len)
+		return -1;
+	return 0;
+}
+
+/* Receives len bytes into buf and up to n descriptors into fds, returns
+ * the number of descriptors or -1. */
+static int
+recvfds(int sock, void *buf, size_t len, int *fds, int n)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} cm;
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *c;
+	ssize_t r;
+	int got = 0;
+
+	msg.msg_control = cm.buf;
+	msg.msg_controllen = sizeof cm.buf;
+	while ((r = recvmsg(sock, &msg, 0)) == -1 && errno == EINTR)
+		;
+	if (r <= 0)
+		return -1;
+	for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+			got = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(c), MIN(got, n) * sizeof(int));
+		}
+	if (got > n || readall(sock, (char *)buf + r, len - r) == -1)
+		return -1;
+	return got;
+}
+
+/* whether the environment entry s sets the locale */
+static int
+localevar(const char *s)
+{
+	return !strncmp(s, "LANG=", 5) || !strncmp(s, "LC_", 3);
+}
+
+/* Hands the menu to a daemon when one listens for the display: passes
+ * it the standard streams, the working directory, the locale variables
+ * and the arguments, and exits with the status it reports. Returns when
+ * there is no daemon. */
+static void
+client(int argc, char *argv[])
+{
+	extern char **environ;
+	const char *path = sockpath();
+	char cwd[PATH_MAX], *buf, *p, **e, status;
+	int i, sock, fds[] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	uint32_t len;
+
+	if (!path || (sock = sockconnect(path)) == -1)
+		return;
+	if (!getcwd(cwd, sizeof cwd))
+		die("getcwd:");
+	/* the directory, the locale variables up to an empty string, the arguments */
+	len = strlen(cwd) + 2;
+	for (e = environ; *e; e++)
+		if (localevar(*e))
+			len += strlen(*e) + 1;
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	p = buf = ecalloc(1, len);
+	p = stpcpy(p, cwd) + 1;
+	for (e = environ; *e; e++)
+		if (localevar(*e))
+			p = stpcpy(p, *e) + 1;
+	p++;
+	for (i = 0; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+	if (sendfds(sock, &len, sizeof len, fds, LENGTH(fds)) == -1 ||
+	    writeall(sock, buf, len) == -1)
+		die("cannot reach the daemon:");
+	exit(readall(sock, &status, 1) == -1 ? 1 : (unsigned char)status);
+}
+
+/* Waits in a spare menu for the client serve() hands over on sock, then
+ * takes over its streams and working directory and returns its
+ * arguments. */
+static void
+takeclient(int sock, int *argc, char ***argv)
+{
+	extern char **environ;
+	char ascii[0x7f - ' ' + 1], warm[64], *buf, *p, *args, c, **v, **e;
+	int i, n, fds[3], client;
+	uint32_t len;
+
+	xinit();
+	snprintf(warm, sizeof warm, "%s", setlocale(LC_CTYPE, NULL));
+	/* the glyph cache starts with ASCII */
+	for (i = 0; i < LENGTH(ascii) - 1; i++)
+		ascii[i] = ' ' + i;
+	ascii[i] = '\0';
+	drw_fontset_getwidth(drw, ascii);
+	XSync(dpy, False);
+
+	if (recvfds(sock, &c, 1, &client, 1) != 1)
+		exit(0); /* the daemon is gone */
+	close(sock);
+	if (recvfds(client, &len, sizeof len, fds, LENGTH(fds)) != LENGTH(fds))
+		die("bad request from a client");
+	buf = ecalloc(1, len + 1);
+	if (readall(client, buf, len) == -1)
+		die("bad request from a client");
+	close(client);
+	for (i = 0; i < LENGTH(fds); i++) {
+		if (dup2(fds[i], i) == -1)
+			die("dup2:");
+		if (fds[i] != i)
+			close(fds[i]);
+	}
+	if (chdir(buf) == -1)
+		die("chdir %s:", buf);
+
+	/* the menu runs in the client's locale rather than the daemon's */
+	for (e = environ; *e; )
+		if (localevar(*e)) {
+			p = strndup(*e, strcspn(*e, "="));
+			unsetenv(p);
+			free(p);
+			e = environ;
+		} else {
+			e++;
+		}
+	for (p = buf + strlen(buf) + 1; p < buf + len && *p; p += strlen(p) + 1)
+		putenv(p);
+	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
+		fputs("warning: no locale support\n", stderr);
+	if (strcmp(warm, setlocale(LC_CTYPE, NULL))) {
+		XCloseIM(xim);
+		if (!(xim = XOpenIM(dpy, NULL, NULL, NULL)))
+			die("XOpenIM failed: could not open input device");
+	}
+
+	args = p + 1;
+	for (n = 0, p = args; p < buf + len; p += strlen(p) + 1)
+		n++;
+	v = ecalloc(n + 1, sizeof *v);
+	for (i = 0, p = args; i < n; p += strlen(p) + 1)
+		v[i++] = p;
+	*argc = n;
+	*argv = v;
+}
+
+static void
+sigchld(int sig)
+{
+	/* only interrupts pselect() in serve() */
+}
+
+/* Listens for clients on sockpath(), keeping a spare menu process that
+ * connected to X and loaded its fonts and colors ahead of time. Each
+ * client is handed to the spare, which shows its menu while the next
+ * spare starts, and is sent the status the menu exits with. Returns in
+ * the spare with the client's arguments. */
+static void
+serve(int *argc, char ***argv)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct sigaction act = { .sa_handler = sigchld };
+	struct {
+		pid_t pid;
+		int fd; /* the client */
+	} *sessions = NULL;
+	size_t nsessions = 0, i;
+	const char *path = sockpath();
+	sigset_t block, unblocked;
+	struct timespec ts;
+	fd_set fds;
+	pid_t spare = 0, pid;
+	time_t started = 0, respawn = 0, backoff = 0, now;
+	int lfd, sp[2], fd, status;
+	char st;
+
+	if (!path)
+		die("XDG_RUNTIME_DIR and DISPLAY are needed to name the socket");
+	if ((fd = sockconnect(path)) != -1)
+		die("a daemon already listens on %s", path);
+	unlink(path);
+	strcpy(sa.sun_path, path);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    bind(lfd, (struct sockaddr *)&sa, sizeof sa) == -1 ||
+	    listen(lfd, 8) == -1)
+		die("%s:", path);
+	/* SIGCHLD is only let through while waiting for clients */
+	sigemptyset(&block);
+	sigaddset(&block, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &block, &unblocked);
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGCHLD, &act, NULL);
+	/* a client may be gone by the time its menu exits */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		if (!spare && time(NULL) >= respawn) {
+			started = time(NULL);
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1)
+				die("socketpair:");
+			if ((spare = fork()) == -1)
+				die("fork:");
+			if (!spare) {
+				close(lfd);
+				close(sp[0]);
+				for (i = 0; i < nsessions; i++)
+					close(sessions[i].fd);
+				free(sessions);
+				signal(SIGCHLD, SIG_DFL);
+				signal(SIGPIPE, SIG_DFL);
+				sigprocmask(SIG_SETMASK, &unblocked, NULL);
+				takeclient(sp[1], argc, argv);
+				return;
+			}
+			close(sp[1]);
+		}
+		/* tell the clients of the menus that exited how they did */
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			if (spare && pid == spare) {
+				/* start another, later if they keep failing */
+				fprintf(stderr, "dmenu: the spare menu exited\n");
+				close(sp[0]);
+				spare = 0;
+				now = time(NULL);
+				backoff = now - started < 5 ? MIN(MAX(2 * backoff, 1), 60) : 0;
+				respawn = now + backoff;
+				continue;
+			}
+			for (i = 0; i < nsessions && sessions[i].pid != pid; i++)
+				;
+			if (i == nsessions)
+				continue;
+			st = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+			writeall(sessions[i].fd, &st, 1);
+			close(sessions[i].fd);
+			sessions[i] = sessions[--nsessions];
+		}
+		/* clients wait in the backlog until there is a spare */
+		FD_ZERO(&fds);
+		if (spare)
+			FD_SET(lfd, &fds);
+		ts.tv_sec = MAX(respawn - time(NULL), 0);
+		ts.tv_nsec = 0;
+		if (pselect(lfd + 1, &fds, NULL, NULL, spare ? NULL : &ts, &unblocked) == -1) {
+			if (errno == EINTR)
+				continue;
+			die("pselect:");
+		}
+		if (!FD_ISSET(lfd, &fds))
+			continue;
+		if ((fd = accept(lfd, NULL, NULL)) == -1)
+			continue;
+		if (sendfds(sp[0], "", 1, &fd, 1) == -1) {
+			/* it exited unreaped, the loop sees to it */
+			fprintf(stderr, "dmenu: cannot hand a client to the spare menu: %s\n",
+			        strerror(errno));
+			close(fd);
+			continue;
+		}
+		close(sp[0]);
+		if (!(sessions = realloc(sessions, (nsessions + 1) * sizeof *sessions)))
+			die("cannot realloc %u bytes:", (nsessions + 1) * sizeof *sessions);
+		sessions[nsessions].pid = spare;
+		sessions[nsessions++].fd = fd;
+		spare = 0;
+	}
+}
+
 int
 main(int argc, char *argv[])
 {
 	XWindowAttributes wa;
 	int i, fast = 0;
 
+	if (argc == 2 && !strcmp(argv[1], "-daemon"))
+		serve(&argc, &argv); /* returns in a spare menu, with a client's arguments */
+	else
+		client(argc, argv);
+
 	for (i = 1; i < argc; i++)
 		/* these options take no arguments */
 		if (!strcmp(argv[i], "-v")) {      /* prints version information */
@@ -1326,6 +3230,8 @@ main(int argc, char *argv[])
 			fast = 1;
 		else if (!strcmp(argv[i], "-F"))   /* grabs keyboard before reading stdin */
 			fuzzy = 0;
+		else if (!strcmp(argv[i], "-s"))   /* reads stdin while the menu is shown */
+			stream = 1;
 		else if (!strcmp(argv[i], "-c"))   /* centers dmenu on screen */
 			centered = 1;
 		else if (!strcmp(argv[i], "-i")) { /* case-insensitive item matching */
@@ -1343,6 +3249,8 @@ main(int argc, char *argv[])
 			if (lines == 0) lines = 1;
 		} else if (!strcmp(argv[i], "-H"))
 			histfile = argv[++i];
+		else if (!strcmp(argv[i], "-C"))   /* keeps processed input in a directory */
+			cachedir = argv[++i];
 		else if (!strcmp(argv[i], "-l")) { /* number of lines in grid */
 			lines = atoi(argv[++i]);
 			if (columns == 0) columns = 1;
@@ -1386,47 +3294,12 @@ main(int argc, char *argv[])
 		else
 			usage();
 
-	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
-		fputs("warning: no locale support\n", stderr);
-	if (!(dpy = XOpenDisplay(NULL)))
-		die("cannot open display");
-	screen = DefaultScreen(dpy);
-	root = RootWindow(dpy, screen);
+	xinit();
 	if (!embed || !(parentwin = strtol(embed, NULL, 0)))
 		parentwin = root;
 	if (!XGetWindowAttributes(dpy, parentwin, &wa))
 		die("could not get embedding window attributes: 0x%lx",
 		    parentwin);
-	drw = drw_create(dpy, screen, root, wa.width, wa.height);
-	readxresources();
-	/* Now we check whether to override xresources with commandline parameters */
-	if ( tempfonts )
-	   fonts[0] = strdup(tempfonts);
-	if ( colortemp[0])
-	   colors[SchemeNorm][ColBg] = strdup(colortemp[0]);
-	if ( colortemp[1])
-	   colors[SchemeNorm][ColFg] = strdup(colortemp[1]);
-	if ( colortemp[2])
-	   colors[SchemeSel][ColBg]  = strdup(colortemp[2]);
-	if ( colortemp[3])
-	   colors[SchemeSel][ColFg]  = strdup(colortemp[3]);
-	if ( colortemp[4])
-	   colors[SchemeHp][ColBg] = strdup(colortemp[4]);
-	if ( colortemp[5])
-	   colors[SchemeHp][ColFg]  = strdup(colortemp[5]);
-	if ( colortemp[6])
-	   colors[SchemeNormHighlight][ColBg]  = strdup(colortemp[6]);
-	if ( colortemp[7])
-	   colors[SchemeNormHighlight][ColFg] = strdup(colortemp[7]);
-	if ( colortemp[8])
-	   colors[SchemeSelHighlight][ColBg]  = strdup(colortemp[8]);
-	if ( colortemp[9])
-	   colors[SchemeSelHighlight][ColFg]  = strdup(colortemp[9]);
-	if (!drw_fontset_create(drw, (const char**)fonts, LENGTH(fonts)))
-		die("no fonts could be loaded.");
-
-	// free(fonts[0]);
-	lrpad = drw->fonts->h;
 
 #ifdef __OpenBSD__
 	if (pledge("stdio rpath", NULL) == -1)
@@ -1434,6 +3307,7 @@ main(int argc, char *argv[])
 #endif
 
 	loadhistory();
+	hpcompile();
 
 	if (fast && !isatty(0)) {
 		grabkeyboard();
@@ -1,4 +1,5 @@
 /* See LICENSE file for copyright and license details. */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -88,14 +89,39 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	if (drw->xftdraw)
+		XftDrawChange(drw->xftdraw, drw->drawable);
+	drw->nrects = drw->nruns = 0;
+}
+
+static void
+glyphs_free(Drw *drw)
+{
+	free(drw->glyphs);
+	free(drw->xglyphs);
+	drw->glyphs = drw->xglyphs = NULL;
+	drw->xglyphsn = drw->xglyphssz = 0;
 }
 
 void
 drw_free(Drw *drw)
 {
+	size_t i;
+
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
 	drw_fontset_free(drw->fonts);
+	glyphs_free(drw);
+	if (drw->xftdraw)
+		XftDrawDestroy(drw->xftdraw);
+	for (i = 0; i < drw->rectssz; i++)
+		free(drw->rects[i].r);
+	for (i = 0; i < drw->runssz; i++) {
+		free(drw->runs[i].g);
+		free(drw->runs[i].box);
+	}
+	free(drw->rects);
+	free(drw->runs);
 	free(drw);
 }
 
@@ -181,6 +207,7 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 			ret = cur;
 		}
 	}
+	glyphs_free(drw);
 	return (drw->fonts = ret);
 }
 
@@ -225,8 +252,10 @@ drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount)
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
+	if (drw && drw->fonts != set) {
+		glyphs_free(drw);
 		drw->fonts = set;
+	}
 }
 
 void
@@ -236,35 +265,321 @@ drw_setscheme(Drw *drw, Clr *scm)
 		drw->scheme = scm;
 }
 
+static int
+overlaps(const XRectangle *a, const XRectangle *b)
+{
+	return a->x < b->x + b->width && b->x < a->x + a->width &&
+	       a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+static int
+covers(const XRectangle *a, const XRectangle *b)
+{
+	return a->x <= b->x && b->x + b->width <= a->x + a->width &&
+	       a->y <= b->y && b->y + b->height <= a->y + a->height;
+}
+
+/* Paints the queued fills, one XFillRectangles per batch, then the queued
+ * glyphs, one XftDrawGlyphFontSpec per color. */
+static void
+flush(Drw *drw)
+{
+	Glyphs *run;
+	size_t i, j, n;
+
+	for (i = 0; i < drw->nrects; i++) {
+		XSetForeground(drw->dpy, drw->gc, drw->rects[i].pixel);
+		XFillRectangles(drw->dpy, drw->drawable, drw->gc,
+		                drw->rects[i].r, drw->rects[i].n);
+	}
+	if (drw->nruns && !drw->xftdraw)
+		drw->xftdraw = XftDrawCreate(drw->dpy, drw->drawable,
+		                             DefaultVisual(drw->dpy, drw->screen),
+		                             DefaultColormap(drw->dpy, drw->screen));
+	for (i = 0; i < drw->nruns; i++) {
+		run = &drw->runs[i];
+		for (j = n = 0; j < run->n; j++)
+			if (run->g[j].font)
+				run->g[n++] = run->g[j];
+		if (n)
+			XftDrawGlyphFontSpec(drw->xftdraw, &run->color, run->g, n);
+	}
+	drw->nrects = drw->nruns = 0;
+}
+
+/* Queues a fill. Glyphs it paints over entirely are dropped and ones it
+ * cuts into are painted first. It joins the last batch of its color unless
+ * a batch queued after that one lies under it. */
+static void
+queuerect(Drw *drw, unsigned long pixel, int x, int y, unsigned int w, unsigned int h)
+{
+	XRectangle r = { x, y, w, h };
+	Rects *b;
+	size_t i, j;
+
+	if (!w || !h)
+		return;
+	if (drw->nruns && overlaps(&r, &drw->inked)) {
+		for (i = 0; i < drw->nruns; i++) {
+			for (j = 0; j < drw->runs[i].n; j++) {
+				if (!drw->runs[i].g[j].font || !overlaps(&r, &drw->runs[i].box[j]))
+					continue;
+				if (!covers(&r, &drw->runs[i].box[j]))
+					break;
+				drw->runs[i].g[j].font = NULL;
+			}
+			if (j < drw->runs[i].n) {
+				flush(drw);
+				break;
+			}
+		}
+	}
+
+	for (i = drw->nrects; i && drw->rects[i - 1].pixel != pixel; i--) {
+		for (j = 0; j < drw->rects[i - 1].n && !overlaps(&r, &drw->rects[i - 1].r[j]); j++)
+			; /* NOP */
+		if (j < drw->rects[i - 1].n) {
+			i = 0;
+			break;
+		}
+	}
+	if (!i) {
+		if (drw->nrects == drw->rectssz) {
+			drw->rectssz = drw->rectssz ? drw->rectssz * 2 : 16;
+			if (!(drw->rects = realloc(drw->rects, drw->rectssz * sizeof(Rects))))
+				die("cannot realloc %u bytes:", drw->rectssz * sizeof(Rects));
+			memset(drw->rects + drw->nrects, 0, (drw->rectssz - drw->nrects) * sizeof(Rects));
+		}
+		i = ++drw->nrects;
+		drw->rects[i - 1].pixel = pixel;
+		drw->rects[i - 1].n = 0;
+	}
+	b = &drw->rects[i - 1];
+	if (b->n == b->sz) {
+		b->sz = b->sz ? b->sz * 2 : 64;
+		if (!(b->r = realloc(b->r, b->sz * sizeof(XRectangle))))
+			die("cannot realloc %u bytes:", b->sz * sizeof(XRectangle));
+	}
+	b->r[b->n++] = r;
+}
+
+static void
+queueglyph(Drw *drw, const XftColor *color, XftFont *font, FT_UInt glyph,
+           int x, int ty, const XRectangle *box)
+{
+	Glyphs *run;
+	size_t i;
+
+	for (i = 0; i < drw->nruns && drw->runs[i].color.pixel != color->pixel; i++)
+		; /* NOP */
+	if (i == drw->nruns) {
+		if (drw->nruns == drw->runssz) {
+			drw->runssz = drw->runssz ? drw->runssz * 2 : 4;
+			if (!(drw->runs = realloc(drw->runs, drw->runssz * sizeof(Glyphs))))
+				die("cannot realloc %u bytes:", drw->runssz * sizeof(Glyphs));
+			memset(drw->runs + drw->nruns, 0, (drw->runssz - drw->nruns) * sizeof(Glyphs));
+		}
+		if (!drw->nruns)
+			drw->inked = *box;
+		drw->nruns++;
+		drw->runs[i].color = *color;
+		drw->runs[i].n = 0;
+	}
+	run = &drw->runs[i];
+	if (run->n == run->sz) {
+		run->sz = run->sz ? run->sz * 2 : 256;
+		if (!(run->g = realloc(run->g, run->sz * sizeof(XftGlyphFontSpec))))
+			die("cannot realloc %u bytes:", run->sz * sizeof(XftGlyphFontSpec));
+		if (!(run->box = realloc(run->box, run->sz * sizeof(XRectangle))))
+			die("cannot realloc %u bytes:", run->sz * sizeof(XRectangle));
+	}
+	run->g[run->n].font = font;
+	run->g[run->n].glyph = glyph;
+	run->g[run->n].x = x;
+	run->g[run->n].y = ty;
+	run->box[run->n++] = *box;
+
+	if (box->x < drw->inked.x) {
+		drw->inked.width += drw->inked.x - box->x;
+		drw->inked.x = box->x;
+	}
+	if (box->y < drw->inked.y) {
+		drw->inked.height += drw->inked.y - box->y;
+		drw->inked.y = box->y;
+	}
+	drw->inked.width = MAX(drw->inked.width, box->x + box->width - drw->inked.x);
+	drw->inked.height = MAX(drw->inked.height, box->y + box->height - drw->inked.y);
+}
+
 void
 drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert)
 {
 	if (!drw || !drw->scheme)
 		return;
-	XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
-	if (filled)
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-	else
+	if (filled) {
+		queuerect(drw, drw->scheme[invert ? ColBg : ColFg].pixel, x, y, w, h);
+	} else {
+		flush(drw);
+		XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
+	}
 }
 
-int
-drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
+/* Looks up a system font for a codepoint no font of the set has. A font
+ * that has it is appended to the set and returned, otherwise the first
+ * font of the set is. */
+static Fnt *
+xfont_fallback(Drw *drw, long codepoint)
 {
-	char buf[1024];
-	int ty;
-	unsigned int ew;
-	XftDraw *d = NULL;
-	Fnt *usedfont, *curfont, *nextfont;
-	size_t i, len;
-	int utf8strlen, utf8charlen, render = x || y || w || h;
-	long utf8codepoint = 0;
-	const char *utf8str;
+	Fnt *font, *cur;
 	FcCharSet *fccharset;
 	FcPattern *fcpattern;
 	FcPattern *match;
 	XftResult result;
-	int charexists = 0;
+
+	if (!drw->fonts->pattern) {
+		/* Refer to the comment in xfont_create for more information. */
+		die("the first font in the cache must be loaded from a font string.");
+	}
+
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, codepoint);
+
+	fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+	FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
+
+	FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+	match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+
+	FcCharSetDestroy(fccharset);
+	FcPatternDestroy(fcpattern);
+
+	if (!match)
+		return drw->fonts;
+	font = xfont_create(drw, NULL, match);
+	if (font && XftCharExists(drw->dpy, font->xfont, codepoint)) {
+		for (cur = drw->fonts; cur->next; cur = cur->next)
+			; /* NOP */
+		cur->next = font;
+		return font;
+	}
+	xfont_free(font);
+	return drw->fonts;
+}
+
+/* Returns the cache slot of a codepoint outside the BMP, inserting it
+ * if it is not there yet. */
+static Gly *
+xglyph(Drw *drw, unsigned int cp)
+{
+	Gly *old;
+	size_t i, j, oldsz;
+
+	for (i = cp & (drw->xglyphssz - 1); drw->xglyphssz && drw->xglyphs[i].cp;
+	     i = (i + 1) & (drw->xglyphssz - 1))
+		if (drw->xglyphs[i].cp == cp)
+			return &drw->xglyphs[i];
+
+	if (2 * (drw->xglyphsn + 1) > drw->xglyphssz) {
+		old = drw->xglyphs;
+		oldsz = drw->xglyphssz;
+		drw->xglyphssz = oldsz ? oldsz * 2 : 256;
+		drw->xglyphs = ecalloc(drw->xglyphssz, sizeof(Gly));
+		for (j = 0; j < oldsz; j++) {
+			if (!old[j].cp)
+				continue;
+			for (i = old[j].cp & (drw->xglyphssz - 1); drw->xglyphs[i].cp;
+			     i = (i + 1) & (drw->xglyphssz - 1))
+				; /* NOP */
+			drw->xglyphs[i] = old[j];
+		}
+		free(old);
+		for (i = cp & (drw->xglyphssz - 1); drw->xglyphs[i].cp;
+		     i = (i + 1) & (drw->xglyphssz - 1))
+			; /* NOP */
+	}
+	drw->xglyphsn++;
+	drw->xglyphs[i].cp = cp;
+	return &drw->xglyphs[i];
+}
+
+/* Returns the font a codepoint is drawn with, its glyph there and its
+ * advance: the first font of the set having it, a fallback font, or the
+ * first font when fontconfig has none either, which is remembered like
+ * the others. Lookups after the first one make no Xlib or Xft calls, so
+ * fontconfig is asked once per codepoint until the fontset changes. */
+static const Gly *
+drw_glyph(Drw *drw, long codepoint)
+{
+	Gly *g;
+	Fnt *font, *cur;
+	FcChar32 ucs4 = codepoint;
+	XGlyphInfo ext;
+	unsigned int i;
+
+	if (codepoint < 0x10000) {
+		if (!drw->glyphs)
+			drw->glyphs = ecalloc(0x10000, sizeof(Gly));
+		g = &drw->glyphs[codepoint];
+	} else {
+		g = xglyph(drw, codepoint);
+	}
+	if (g->font)
+		return g;
+
+	for (font = drw->fonts; font; font = font->next)
+		if (XftCharExists(drw->dpy, font->xfont, ucs4))
+			break;
+	if (!font)
+		font = xfont_fallback(drw, codepoint);
+	for (i = 1, cur = drw->fonts; cur != font; cur = cur->next)
+		i++;
+
+	if (i > UCHAR_MAX) {
+		/* past 255 fonts, codepoints are drawn with the first one */
+		font = drw->fonts;
+		i = 1;
+	}
+	g->glyph = XftCharIndex(drw->dpy, font->xfont, ucs4);
+	XftGlyphExtents(drw->dpy, font->xfont, &g->glyph, 1, &ext);
+	g->w = ext.xOff;
+	g->inkx = -ext.x;
+	g->inky = -ext.y;
+	g->inkw = ext.width;
+	g->inkh = ext.height;
+	g->font = i;
+	return g;
+}
+
+/* the font at position i + 1 of the set, as Gly.font counts */
+static Fnt *
+fontat(Drw *drw, unsigned int i)
+{
+	Fnt *font;
+
+	for (font = drw->fonts; --i && font->next; font = font->next)
+		; /* NOP */
+	return font;
+}
+
+int
+drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
+{
+	char buf[1024];
+	int tx, ty, render = x || y || w || h;
+	unsigned int ew, fitw;
+	XRectangle box;
+	XGlyphInfo ext;
+	FT_UInt glyph;
+	const Gly *g;
+	Fnt *usedfont;
+	size_t i, n, len, runlen;
+	long codepoint;
+	const char *run;
+	unsigned char font;
 
 	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
 		return 0;
@@ -272,109 +587,69 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	if (!render) {
 		w = ~w;
 	} else {
-		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
+		queuerect(drw, drw->scheme[invert ? ColFg : ColBg].pixel, x, y, w, h);
 		x += lpad;
 		w -= lpad;
 	}
 
-	usedfont = drw->fonts;
-	while (1) {
-		utf8strlen = 0;
-		utf8str = text;
-		nextfont = NULL;
-		while (*text) {
-			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
-				}
-			}
-
-			if (!charexists || nextfont)
+	while (*text) {
+		/* take the run of characters drawn with one font, noting how
+		 * much of it fits */
+		run = text;
+		font = 0;
+		ew = fitw = len = 0;
+		for (; *text; text += n) {
+			n = utf8decode(text, &codepoint, UTF_SIZ);
+			g = drw_glyph(drw, codepoint);
+			if (font && g->font != font)
 				break;
-			else
-				charexists = 0;
-		}
-
-		if (utf8strlen) {
-			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
-			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
-
-			if (len) {
-				memcpy(buf, utf8str, len);
-				buf[len] = '\0';
-				if (len < utf8strlen)
-					for (i = len; i && i > len - 3; buf[--i] = '.')
-						; /* NOP */
-
-				if (render) {
-					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
-				}
-				x += ew;
-				w -= ew;
+			font = g->font;
+			ew += g->w;
+			if (ew <= w && (size_t)(text + n - run) < sizeof(buf)) {
+				fitw = ew;
+				len = text + n - run;
 			}
 		}
-
-		if (!*text) {
-			break;
-		} else if (nextfont) {
-			charexists = 0;
-			usedfont = nextfont;
-		} else {
-			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
-			charexists = 1;
-
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
-
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-			FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
-
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
-
-			if (match) {
-				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					usedfont = drw->fonts;
+		runlen = text - run;
+		usedfont = fontat(drw, font);
+
+		if (len) {
+			memcpy(buf, run, len);
+			buf[len] = '\0';
+			if (len < runlen)
+				for (i = len; i && i > len - 3; buf[--i] = '.')
+					; /* NOP */
+
+			if (render) {
+				ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
+				for (i = 0, tx = x; i < len && (n = utf8decode(buf + i, &codepoint, UTF_SIZ)); i += n) {
+					g = drw_glyph(drw, codepoint);
+					if (g->font == font) {
+						glyph = g->glyph;
+						ext.x = -g->inkx;
+						ext.y = -g->inky;
+						ext.width = g->inkw;
+						ext.height = g->inkh;
+						ext.xOff = g->w;
+					} else {
+						glyph = XftCharIndex(drw->dpy, usedfont->xfont, codepoint);
+						XftGlyphExtents(drw->dpy, usedfont->xfont, &glyph, 1, &ext);
+					}
+					/* the ink, which may stick out of the advance; fills
+					 * queued later have to meet even an empty one */
+					box.x = tx - ext.x;
+					box.y = ty - ext.y;
+					box.width = MAX(ext.width, 1);
+					box.height = MAX(ext.height, 1);
+					queueglyph(drw, &drw->scheme[invert ? ColBg : ColFg],
+					           usedfont->xfont, glyph, tx, ty, &box);
+					tx += ext.xOff;
 				}
 			}
+			x += fitw;
+			w -= fitw;
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
 
 	return x + (render ? w : 0);
 }
@@ -385,16 +660,42 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 	if (!drw)
 		return;
 
-	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
+	drw_copy(drw, win, x, y, w, h);
 	XSync(drw->dpy, False);
 }
 
+/* like drw_map() without waiting for the server, to map several areas */
+void
+drw_copy(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
+{
+	if (!drw)
+		return;
+
+	flush(drw);
+	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
+}
+
 unsigned int
 drw_fontset_getwidth(Drw *drw, const char *text)
 {
+	return drw_fontset_getwidth_n(drw, text, (size_t)-1);
+}
+
+/* width of the characters starting in the first n bytes of text */
+unsigned int
+drw_fontset_getwidth_n(Drw *drw, const char *text, size_t n)
+{
+	unsigned int w = 0;
+	long codepoint;
+	const char *s;
+
 	if (!drw || !drw->fonts || !text)
 		return 0;
-	return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+	for (s = text; *s && (size_t)(s - text) < n;) {
+		s += utf8decode(s, &codepoint, UTF_SIZ);
+		w += drw_glyph(drw, codepoint)->w;
+	}
+	return w;
 }
 
 void
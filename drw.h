@@ -15,6 +15,28 @@ typedef struct Fnt {
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
+typedef struct {
+	unsigned int cp;     /* key, only used outside the BMP */
+	FT_UInt glyph;       /* index in the font */
+	short inkx, inky;    /* ink box, from the origin */
+	unsigned short inkw, inkh;
+	unsigned short w;    /* advance */
+	unsigned char font;  /* position of the font in the set + 1, 0 if unknown */
+} Gly;
+
+typedef struct {
+	unsigned long pixel;
+	XRectangle *r;
+	size_t n, sz;
+} Rects;
+
+typedef struct {
+	XftColor color;
+	XftGlyphFontSpec *g; /* font is NULL once painted over */
+	XRectangle *box;     /* ink of each glyph, at least 1x1 */
+	size_t n, sz;
+} Glyphs;
+
 typedef struct {
 	unsigned int w, h;
 	Display *dpy;
@@ -24,6 +46,15 @@ typedef struct {
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	Gly *glyphs;  /* BMP codepoints of the fontset, allocated on use */
+	Gly *xglyphs; /* hash of the other codepoints */
+	size_t xglyphsn, xglyphssz;
+	XftDraw *xftdraw;
+	Rects *rects;   /* fills queued until drw_copy(), in painting order */
+	size_t nrects, rectssz;
+	Glyphs *runs;   /* glyphs queued until drw_copy(), one run per color */
+	size_t nruns, runssz;
+	XRectangle inked; /* bounds of the queued glyphs */
 } Drw;
 
 /* Drawable abstraction */
@@ -35,6 +66,7 @@ void drw_free(Drw *drw);
 Fnt *drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount);
 void drw_fontset_free(Fnt* set);
 unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
+unsigned int drw_fontset_getwidth_n(Drw *drw, const char *text, size_t n);
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
 
 /* Colorscheme abstraction */
@@ -55,3 +87,4 @@ int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned in
 
 /* Map functions */
 void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
+void drw_copy(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
@@ -1,8 +1,14 @@
 /* See LICENSE file for copyright and license details. */
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,61 +18,804 @@
 char *argv0;
 
 #define FLAG(x)  (flag[(x)-'a'])
+#define LENGTH(x) (sizeof (x) / sizeof (x)[0])
+#define MAXTHREADS 16
 
-static void test(const char *, const char *);
+/* names an operand yielded, as kept by -C */
+struct run {
+	char *arg;
+	struct timespec mtime; /* of the operand when it was listed */
+	char **names;          /* sorted */
+	size_t n, sz;
+	int todo, done;        /* to be listed, listed by a worker */
+};
+
+/* a directory of the -R walk; with -S the tree is kept until printed */
+struct node {
+	char *path;            /* as printed, the operand for a root */
+	int fd;                /* the directory opened by its parent, -1 for a root */
+	int depth;
+	char *out;             /* lines passing, with -S sorted */
+	size_t outlen, outsz;
+	struct node **kids;    /* with -S, subdirectories sorted by name */
+	size_t nkids, kidssz;
+	int done;
+};
+
+/* the nodes a worker walks; its own end is taken last in, first out for
+ * locality, idle workers steal the other end, the larger subtrees */
+struct deque {
+	pthread_mutex_t lock;
+	struct node **v;
+	size_t head, tail, sz;
+};
+
+static int test(int, const char *, const char *, int, int);
 static void usage(void);
 
 static int match = 0;
 static int flag[26];
 static struct stat old, new;
+static char *cachefile;
+static struct run *cached;
+static size_t ncached;
+static struct timespec cachetime;
+static int needstat;         /* a test needs more of the inode than its type */
+static uid_t uid;            /* real ids, as access(2) checks with */
+static gid_t *gids;
+static int ngids;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t listed = PTHREAD_COND_INITIALIZER;
+static struct run *jobs;
+static size_t njobs, nextjob;
+static int recurse, sorted; /* -R, -S */
+static int maxdepth = -1;
+static char **ignores;
+static size_t nignores;
+static struct deque *deques;
+static int nworkers, nidle;
+static size_t pending;      /* nodes queued or being walked */
+static size_t queuedfds, maxqueuedfds; /* directories held open in the deques */
+static pthread_mutex_t walklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walkcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t printable = PTHREAD_COND_INITIALIZER;
 
-static void
-test(const char *path, const char *name)
+/* the mode a d_type stands for, 0 if it does not tell what stat(2) sees */
+static mode_t
+dtmode(int type)
+{
+	switch (type) {
+	case DT_BLK:  return S_IFBLK;
+	case DT_CHR:  return S_IFCHR;
+	case DT_DIR:  return S_IFDIR;
+	case DT_FIFO: return S_IFIFO;
+	case DT_REG:  return S_IFREG;
+	case DT_SOCK: return S_IFSOCK;
+	default:      return 0; /* unknown, or a link stat(2) would follow */
+	}
+}
+
+static int
+types(mode_t m)
+{
+	return (!FLAG('b') || S_ISBLK(m))                             /* block special     */
+	&& (!FLAG('c') || S_ISCHR(m))                                 /* character special */
+	&& (!FLAG('d') || S_ISDIR(m))                                 /* directory         */
+	&& (!FLAG('f') || S_ISREG(m))                                 /* regular file      */
+	&& (!FLAG('p') || S_ISFIFO(m));                               /* named pipe        */
+}
+
+/* access(2) worked out from the mode bits and the real ids for entries
+ * whose type the directory tells; ACLs and security modules are only
+ * consulted for links and entries of unknown type */
+static int
+permitted(int dfd, const char *path, const struct stat *st, int type,
+          int noexec, int how)
+{
+	mode_t bits;
+	int i;
+
+	if (!dtmode(type) || how == W_OK) /* writing depends on mount and inode flags */
+		return faccessat(dfd, path, how, 0) == 0;
+	if (how == X_OK && noexec && S_ISREG(st->st_mode))
+		return 0;
+	if (uid == 0)
+		return how == R_OK || S_ISDIR(st->st_mode) || st->st_mode & 0111;
+	bits = how == R_OK ? S_IROTH : S_IXOTH;
+	if (st->st_uid == uid)
+		return !!(st->st_mode & bits << 6);
+	for (i = 0; i < ngids; i++)
+		if (st->st_gid == gids[i])
+			return !!(st->st_mode & bits << 3);
+	return !!(st->st_mode & bits);
+}
+
+/* test path, relative to the directory dfd; type is its d_type, noexec
+ * whether its directory is on a noexec mount */
+static int
+test(int dfd, const char *path, const char *name, int type, int noexec)
 {
 	struct stat st, ln;
+	mode_t m;
+
+	if (!FLAG('a') && name[0] == '.')                             /* hidden files      */
+		return FLAG('v');
+	if ((m = dtmode(type)) && !types(m))
+		return FLAG('v');
+	if (m && !needstat)
+		st.st_mode = m;
+	else if (fstatat(dfd, path, &st, 0))
+		return FLAG('v');
 
-	if ((!stat(path, &st) && (FLAG('a') || name[0] != '.')        /* hidden files      */
-	&& (!FLAG('b') || S_ISBLK(st.st_mode))                        /* block special     */
-	&& (!FLAG('c') || S_ISCHR(st.st_mode))                        /* character special */
-	&& (!FLAG('d') || S_ISDIR(st.st_mode))                        /* directory         */
-	&& (!FLAG('e') || access(path, F_OK) == 0)                    /* exists            */
-	&& (!FLAG('f') || S_ISREG(st.st_mode))                        /* regular file      */
+	return (types(st.st_mode)
+	&& (!FLAG('e') || m || faccessat(dfd, path, F_OK, 0) == 0)    /* exists            */
 	&& (!FLAG('g') || st.st_mode & S_ISGID)                       /* set-group-id flag */
-	&& (!FLAG('h') || (!lstat(path, &ln) && S_ISLNK(ln.st_mode))) /* symbolic link     */
+	&& (!FLAG('h') || (type == DT_LNK || (type == DT_UNKNOWN      /* symbolic link     */
+	    && !fstatat(dfd, path, &ln, AT_SYMLINK_NOFOLLOW) && S_ISLNK(ln.st_mode))))
 	&& (!FLAG('n') || st.st_mtime > new.st_mtime)                 /* newer than file   */
 	&& (!FLAG('o') || st.st_mtime < old.st_mtime)                 /* older than file   */
-	&& (!FLAG('p') || S_ISFIFO(st.st_mode))                       /* named pipe        */
-	&& (!FLAG('r') || access(path, R_OK) == 0)                    /* readable          */
+	&& (!FLAG('r') || permitted(dfd, path, &st, type, noexec, R_OK)) /* readable     */
 	&& (!FLAG('s') || st.st_size > 0)                             /* not empty         */
 	&& (!FLAG('u') || st.st_mode & S_ISUID)                       /* set-user-id flag  */
-	&& (!FLAG('w') || access(path, W_OK) == 0)                    /* writable          */
-	&& (!FLAG('x') || access(path, X_OK) == 0)) != FLAG('v')) {   /* executable        */
-		if (FLAG('q'))
-			exit(0);
+	&& (!FLAG('w') || permitted(dfd, path, &st, type, noexec, W_OK)) /* writable     */
+	&& (!FLAG('x') || permitted(dfd, path, &st, type, noexec, X_OK))) != FLAG('v'); /* executable */
+}
+
+static void *
+ecalloc(size_t nmemb, size_t size)
+{
+	void *p;
+
+	if (!(p = calloc(nmemb, size))) {
+		perror("calloc");
+		exit(2);
+	}
+	return p;
+}
+
+static void *
+erealloc(void *p, size_t size)
+{
+	if (!(p = realloc(p, size))) {
+		perror("realloc");
+		exit(2);
+	}
+	return p;
+}
+
+static void
+pass(const char *name, struct run *r)
+{
+	if (r) {
+		if (r->n == r->sz) {
+			r->sz = r->sz ? r->sz * 2 : 64;
+			r->names = erealloc(r->names, r->sz * sizeof *r->names);
+		}
+		if (!(r->names[r->n++] = strdup(name))) {
+			perror("strdup");
+			exit(2);
+		}
+		return;
+	}
+	if (FLAG('q'))
+		exit(0);
+	match = 1;
+	puts(name);
+}
+
+/* test the operand, or with -l the contents of the directory it names,
+ * stating each entry relative to the directory; passing names are
+ * printed, or kept in r when it is given */
+static void
+scan(const char *arg, struct run *r)
+{
+	struct dirent *d;
+	DIR *dir = NULL;
+	int fd, noexec = 0;
+
+	if (FLAG('l') && (fd = open(arg, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0
+	&& !(dir = fdopendir(fd)))
+		close(fd);
+	if (!dir) {
+		if (test(AT_FDCWD, arg, arg, DT_UNKNOWN, 0))
+			pass(arg, r);
+		return;
+	}
+#ifdef ST_NOEXEC
+	if (FLAG('x')) {
+		struct statvfs vfs;
+
+		if (!fstatvfs(fd, &vfs))
+			noexec = !!(vfs.f_flag & ST_NOEXEC);
+	}
+#endif
+	while ((d = readdir(dir)))
+		if (test(fd, d->d_name, d->d_name, d->d_type, noexec))
+			pass(d->d_name, r);
+	closedir(dir);
+}
+
+static void *
+worker(void *unused)
+{
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (nextjob < njobs && !jobs[nextjob].todo)
+			nextjob++;
+		i = nextjob++;
+		pthread_mutex_unlock(&lock);
+		if (i >= njobs)
+			return NULL;
+		scan(jobs[i].arg, &jobs[i]);
+		pthread_mutex_lock(&lock);
+		jobs[i].done = 1;
+		pthread_cond_broadcast(&listed);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/* list the runs still to do on a thread per processor; with print, their
+ * names are printed in operand order as soon as each is listed */
+static void
+scanall(struct run *runs, size_t n, int print)
+{
+	pthread_t threads[MAXTHREADS];
+	size_t i, j, todo;
+	long nthreads;
+
+	for (todo = i = 0; i < n; i++)
+		todo += runs[i].todo;
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > MAXTHREADS)
+		nthreads = MAXTHREADS;
+	if ((size_t)nthreads > todo)
+		nthreads = todo;
+	jobs = runs;
+	njobs = n;
+	nextjob = 0;
+	for (i = 0; i < (size_t)nthreads; i++)
+		if (pthread_create(&threads[i], NULL, worker, NULL))
+			break;
+	nthreads = i;
+	if (!nthreads) /* list them here */
+		worker(NULL);
+
+	for (i = 0; print && i < n; i++) {
+		pthread_mutex_lock(&lock);
+		while (runs[i].todo && !runs[i].done)
+			pthread_cond_wait(&listed, &lock);
+		pthread_mutex_unlock(&lock);
+		for (j = 0; j < runs[i].n; j++) {
+			pass(runs[i].names[j], NULL);
+			free(runs[i].names[j]);
+		}
+		free(runs[i].names);
+		runs[i].names = NULL;
+	}
+	for (i = 0; i < (size_t)nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static int
+namecmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int
+timecmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	return (a->tv_nsec > b->tv_nsec) - (a->tv_nsec < b->tv_nsec);
+}
+
+/* the header names the tests, for a cache written with other flags is no use */
+static void
+cacheheader(char *buf, size_t size)
+{
+	size_t i, n;
+
+	n = snprintf(buf, size, "stest-cache 1 ");
+	for (i = 0; i < LENGTH(flag) && n + 1 < size; i++)
+		if (flag[i] && i != 'q' - 'a')
+			buf[n++] = 'a' + i;
+	buf[n] = '\0';
+}
+
+/* the cache is text: a header line, then per operand a line
+ * "<mtime sec> <mtime nsec> <count> <operand>" and count names */
+static void
+cacheload(void)
+{
+	struct stat st;
+	char hdr[64], *buf, *p, *e, *nl;
+	struct run *r;
+	size_t i;
+	long long sec;
+	long nsec;
+	unsigned long n;
+	int fd, off;
+
+	if ((fd = open(cachefile, O_RDONLY)) < 0)
+		return;
+	if (fstat(fd, &st) || !(buf = malloc(st.st_size + 1))) {
+		close(fd);
+		return;
+	}
+	for (i = 0; i < (size_t)st.st_size; i += n)
+		if ((ssize_t)(n = read(fd, buf + i, st.st_size - i)) <= 0)
+			break;
+	close(fd);
+	cachetime = st.st_mtim;
+	e = buf + i;
+	*e = '\0';
+
+	cacheheader(hdr, sizeof hdr);
+	if (!(nl = memchr(buf, '\n', e - buf)) || (size_t)(nl - buf) != strlen(hdr)
+	|| memcmp(buf, hdr, nl - buf))
+		goto bad;
+	cached = ecalloc(st.st_size / 4 + 1, sizeof *cached);
+	for (p = nl + 1; p < e; p = nl + 1) {
+		if (!(nl = memchr(p, '\n', e - p)))
+			goto bad;
+		*nl = '\0';
+		if (sscanf(p, "%lld %ld %lu %n", &sec, &nsec, &n, &off) != 3)
+			goto bad;
+		r = &cached[ncached++];
+		r->arg = p + off;
+		r->mtime.tv_sec = sec;
+		r->mtime.tv_nsec = nsec;
+		r->names = ecalloc(n + 1, sizeof *r->names);
+		for (r->n = 0; r->n < n; r->n++) {
+			p = nl + 1;
+			if (p >= e || !(nl = memchr(p, '\n', e - p)))
+				goto bad;
+			*nl = '\0';
+			r->names[r->n] = p;
+		}
+	}
+	return;
+bad:
+	ncached = 0; /* list everything anew */
+}
+
+static void
+cachesave(struct run *runs, size_t n)
+{
+	char hdr[64], *tmp;
+	size_t i, j, len;
+	FILE *fp;
+	int fd;
+
+	len = strlen(cachefile) + sizeof ".XXXXXX";
+	tmp = ecalloc(len, 1);
+	snprintf(tmp, len, "%s.XXXXXX", cachefile);
+	if ((fd = mkstemp(tmp)) < 0 || !(fp = fdopen(fd, "w"))) {
+		perror(tmp);
+		if (fd >= 0)
+			close(fd);
+		free(tmp);
+		return;
+	}
+	cacheheader(hdr, sizeof hdr);
+	fprintf(fp, "%s\n", hdr);
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "%lld %ld %zu %s\n", (long long)runs[i].mtime.tv_sec,
+		        runs[i].mtime.tv_nsec, runs[i].n, runs[i].arg);
+		for (j = 0; j < runs[i].n; j++)
+			fprintf(fp, "%s\n", runs[i].names[j]);
+	}
+	if (fclose(fp) == EOF || rename(tmp, cachefile) < 0) {
+		perror(cachefile);
+		unlink(tmp);
+	}
+	free(tmp);
+}
+
+/* -C: reuse the names of every operand unchanged since the cache was
+ * written, list the others anew, and print the union sorted without
+ * duplicates, as sort -u in the C locale would */
+static void
+cachescan(char **args, size_t nargs)
+{
+	struct stat st;
+	struct run *runs, *r;
+	size_t i, j, *pos, best;
+	const char *last = NULL;
+	int stale = 0;
+
+	cacheload();
+	runs = ecalloc(nargs, sizeof *runs);
+	pos = ecalloc(nargs, sizeof *pos);
+	for (i = 0; i < nargs; i++) {
+		r = &runs[i];
+		r->arg = args[i];
+		if (!stat(args[i], &st))
+			r->mtime = st.st_mtim;
+		for (j = 0; j < ncached; j++)
+			if (!strcmp(cached[j].arg, args[i]))
+				break;
+		/* a change in the tick the cache was written in may not show in the mtime */
+		if (j < ncached && !timecmp(&cached[j].mtime, &r->mtime)
+		&& timecmp(&r->mtime, &cachetime) < 0) {
+			r->names = cached[j].names;
+			r->n = cached[j].n;
+			continue;
+		}
+		r->todo = 1;
+		stale = 1;
+	}
+	scanall(runs, nargs, 0);
+	for (i = 0; i < nargs; i++)
+		if (runs[i].todo)
+			qsort(runs[i].names, runs[i].n, sizeof *runs[i].names, namecmp);
+
+	for (;;) {
+		for (best = nargs, i = 0; i < nargs; i++)
+			if (pos[i] < runs[i].n && (best == nargs
+			|| strcmp(runs[i].names[pos[i]], runs[best].names[pos[best]]) < 0))
+				best = i;
+		if (best == nargs)
+			break;
+		if (!last || strcmp(last, runs[best].names[pos[best]]))
+			pass((last = runs[best].names[pos[best]]), NULL);
+		pos[best]++;
+	}
+	fflush(stdout);
+	if (stale)
+		cachesave(runs, nargs);
+}
+
+static void
+append(char **buf, size_t *len, size_t *sz, const char *s, size_t n)
+{
+	if (*len + n > *sz) {
+		*sz = *sz * 2 > *len + n ? *sz * 2 : *len + n + 4096;
+		*buf = erealloc(*buf, *sz);
+	}
+	memcpy(*buf + *len, s, n);
+	*len += n;
+}
+
+static void
+push(struct deque *q, struct node *n)
+{
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == q->sz) {
+		if (q->head) { /* slide down what is left */
+			memmove(q->v, q->v + q->head, (q->tail - q->head) * sizeof *q->v);
+			q->tail -= q->head;
+			q->head = 0;
+		}
+		if (q->tail == q->sz) {
+			q->sz = q->sz ? q->sz * 2 : 256;
+			q->v = erealloc(q->v, q->sz * sizeof *q->v);
+		}
+	}
+	q->v[q->tail++] = n;
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_mutex_lock(&walklock);
+	pending++;
+	if (nidle)
+		pthread_cond_signal(&walkcond);
+	pthread_mutex_unlock(&walklock);
+}
+
+static struct node *
+take(struct deque *q, int steal)
+{
+	struct node *n = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail)
+		n = steal ? q->v[q->head++] : q->v[--q->tail];
+	if (q->head == q->tail)
+		q->head = q->tail = 0;
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+static struct node *
+stealany(int self)
+{
+	struct node *n;
+	int i;
+
+	for (i = 1; i < nworkers; i++)
+		if ((n = take(&deques[(self + i) % nworkers], 1)))
+			return n;
+	return NULL;
+}
+
+static int
+kidcmp(const void *a, const void *b)
+{
+	return strcmp((*(struct node *const *)a)->path, (*(struct node *const *)b)->path);
+}
+
+/* sort the lines of a directory, each ending in a newline */
+static void
+sortlines(struct node *nd)
+{
+	char **lines, *p, *q, *e, *buf;
+	size_t n = 0, i, len = 0;
+
+	for (p = nd->out, e = p + nd->outlen; p < e; p++)
+		n += *p == '\n';
+	if (n < 2)
+		return;
+	lines = ecalloc(n, sizeof *lines);
+	for (i = 0, p = nd->out; p < e; p = q + 1) {
+		q = memchr(p, '\n', e - p);
+		*q = '\0';
+		lines[i++] = p;
+	}
+	qsort(lines, n, sizeof *lines, namecmp);
+	buf = ecalloc(nd->outlen, 1);
+	for (i = 0; i < n; i++) {
+		p = stpcpy(buf + len, lines[i]);
+		*p = '\n';
+		len = p + 1 - buf;
+	}
+	free(nd->out);
+	free(lines);
+	nd->out = buf;
+}
+
+static int
+ignored(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nignores; i++)
+		if (!fnmatch(ignores[i], name, 0))
+			return 1;
+	return 0;
+}
+
+/* test the entries of a directory, queueing its subdirectories */
+static void
+walk(int self, struct node *nd)
+{
+	struct dirent *d;
+	struct stat st;
+	struct node *kid;
+	char *path;
+	size_t plen, nlen;
+	DIR *dir = NULL;
+	int fd, kfd, noexec = 0, sub, lines = 0, queue;
+
+	/* a root given as a link is followed, as with -l */
+	if ((fd = nd->fd) == -1)
+		fd = open(nd->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0 && !(dir = fdopendir(fd)))
+		close(fd);
+	if (!dir) {
+		/* an operand that is no directory is tested itself, as with -l */
+		if (!nd->depth && test(AT_FDCWD, nd->path, nd->path, DT_UNKNOWN, 0)) {
+			append(&nd->out, &nd->outlen, &nd->outsz, nd->path, strlen(nd->path));
+			append(&nd->out, &nd->outlen, &nd->outsz, "\n", 1);
+			lines++;
+		}
+		goto done;
+	}
+#ifdef ST_NOEXEC
+	if (FLAG('x')) {
+		struct statvfs vfs;
+
+		if (!fstatvfs(fd, &vfs))
+			noexec = !!(vfs.f_flag & ST_NOEXEC);
+	}
+#endif
+	plen = strlen(nd->path);
+	if (plen && nd->path[plen - 1] == '/')
+		plen--;
+	while ((d = readdir(dir))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..") || ignored(d->d_name))
+			continue;
+		sub = (maxdepth < 0 || nd->depth + 1 < maxdepth)
+		   && (FLAG('a') || d->d_name[0] != '.')
+		   && (d->d_type == DT_DIR || (d->d_type == DT_UNKNOWN
+		   && !fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode)));
+		if (!sub && !test(fd, d->d_name, d->d_name, d->d_type, noexec))
+			continue;
+		nlen = strlen(d->d_name);
+		path = ecalloc(plen + nlen + 2, 1);
+		memcpy(path, nd->path, plen);
+		path[plen] = '/';
+		memcpy(path + plen + 1, d->d_name, nlen);
+		if (!sub || test(fd, d->d_name, d->d_name, d->d_type, noexec)) {
+			if (FLAG('q'))
+				exit(0);
+			path[plen + 1 + nlen] = '\n';
+			append(&nd->out, &nd->outlen, &nd->outsz, path, plen + nlen + 2);
+			path[plen + 1 + nlen] = '\0';
+			lines++;
+		}
+		/* opened here, the directory read is the one entered, not a
+		 * link put in its place since, and no path is resolved again */
+		if (!sub || (kfd = openat(fd, d->d_name,
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+			if (sub && (errno == EMFILE || errno == ENFILE))
+				perror(path); /* a subtree left out, not just unreadable */
+			free(path);
+			continue;
+		}
+		kid = ecalloc(1, sizeof *kid);
+		kid->path = path;
+		kid->fd = kfd;
+		kid->depth = nd->depth + 1;
+		if (sorted) {
+			if (nd->nkids == nd->kidssz) {
+				nd->kidssz = nd->kidssz ? nd->kidssz * 2 : 16;
+				nd->kids = erealloc(nd->kids, nd->kidssz * sizeof *nd->kids);
+			}
+			nd->kids[nd->nkids++] = kid;
+		}
+		/* past the descriptors the deques may hold, walk it right away */
+		pthread_mutex_lock(&walklock);
+		if ((queue = queuedfds < maxqueuedfds))
+			queuedfds++;
+		pthread_mutex_unlock(&walklock);
+		if (queue)
+			push(&deques[self], kid);
+		else
+			walk(self, kid);
+	}
+	closedir(dir);
+
+done:
+	if (sorted) {
+		sortlines(nd);
+		qsort(nd->kids, nd->nkids, sizeof *nd->kids, kidcmp);
+		pthread_mutex_lock(&walklock);
+		nd->done = 1;
+		match |= lines > 0;
+		pthread_cond_broadcast(&printable);
+		pthread_mutex_unlock(&walklock);
+		return;
+	}
+	if (nd->outlen) {
+		pthread_mutex_lock(&walklock);
+		fwrite(nd->out, 1, nd->outlen, stdout);
 		match = 1;
-		puts(name);
+		pthread_mutex_unlock(&walklock);
 	}
+	free(nd->out);
+	free(nd->path);
+	free(nd);
+}
+
+static void *
+walker(void *arg)
+{
+	struct node *n;
+	int self = (int)(long)arg, held;
+
+	for (;;) {
+		if (!(n = take(&deques[self], 0)) && !(n = stealany(self))) {
+			pthread_mutex_lock(&walklock);
+			nidle++;
+			while (pending && !(n = stealany(self)))
+				pthread_cond_wait(&walkcond, &walklock);
+			nidle--;
+			pthread_mutex_unlock(&walklock);
+			if (!n)
+				return NULL;
+		}
+		held = n->fd != -1;
+		walk(self, n);
+		pthread_mutex_lock(&walklock);
+		queuedfds -= held;
+		if (!--pending)
+			pthread_cond_broadcast(&walkcond);
+		pthread_mutex_unlock(&walklock);
+	}
+}
+
+/* print a tree walked for -S as its directories are done, in order */
+static void
+printtree(struct node *nd)
+{
+	size_t i;
+
+	pthread_mutex_lock(&walklock);
+	while (!nd->done)
+		pthread_cond_wait(&printable, &walklock);
+	pthread_mutex_unlock(&walklock);
+	fwrite(nd->out, 1, nd->outlen, stdout);
+	for (i = 0; i < nd->nkids; i++)
+		printtree(nd->kids[i]);
+	free(nd->kids);
+	free(nd->out);
+	free(nd->path);
+	free(nd);
+}
+
+/* -R: walk the operands on a thread per processor */
+static void
+walkall(char **args, int nargs)
+{
+	pthread_t threads[MAXTHREADS];
+	struct node **roots;
+	struct rlimit rl;
+	long n;
+	int i;
+
+	/* the other half is left to the directories walked right away */
+	maxqueuedfds = 64;
+	if (!getrlimit(RLIMIT_NOFILE, &rl))
+		maxqueuedfds = rl.rlim_cur == RLIM_INFINITY ? 4096 : rl.rlim_cur / 2;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	nworkers = n < 1 ? 1 : n > MAXTHREADS ? MAXTHREADS : n;
+	deques = ecalloc(nworkers, sizeof *deques);
+	for (i = 0; i < nworkers; i++)
+		pthread_mutex_init(&deques[i].lock, NULL);
+	roots = ecalloc(nargs, sizeof *roots);
+	for (i = nargs - 1; i >= 0; i--) { /* the first is taken first */
+		roots[i] = ecalloc(1, sizeof *roots[i]);
+		roots[i]->fd = -1;
+		if (!(roots[i]->path = strdup(args[i]))) {
+			perror("strdup");
+			exit(2);
+		}
+		push(&deques[0], roots[i]);
+	}
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&threads[i], NULL, walker, (void *)(long)i))
+			break;
+	if (!i) { /* walk here */
+		nworkers = 1;
+		walker((void *)0L);
+	}
+	if (sorted)
+		for (n = 0; n < nargs; n++)
+			printtree(roots[n]);
+	while (i--)
+		pthread_join(threads[i], NULL);
+	free(roots);
 }
 
 static void
 usage(void)
 {
 	fprintf(stderr, "usage: %s [-abcdefghlpqrsuvwx] "
-	        "[-n file] [-o file] [file...]\n", argv0);
+	        "[-n file] [-o file] [-C cachefile] [-RS] [-D depth] "
+	        "[-I pattern] [file...]\n", argv0);
 	exit(2); /* like test(1) return > 1 on error */
 }
 
 int
 main(int argc, char *argv[])
 {
-	struct dirent *d;
-	char path[PATH_MAX], *line = NULL, *file;
-	size_t linesiz = 0;
+	struct run *runs;
+	char *line = NULL, *file;
+	size_t linesiz = 0, i;
 	ssize_t n;
-	DIR *dir;
-	int r;
 
 	ARGBEGIN {
+	case 'C': /* keep the names listed per operand in a cache */
+		cachefile = EARGF(usage());
+		break;
+	case 'D': /* descend no deeper */
+		maxdepth = atoi(EARGF(usage()));
+		if (maxdepth < 1)
+			usage();
+		break;
+	case 'I': /* leave out names matching */
+		ignores = erealloc(ignores, ++nignores * sizeof *ignores);
+		ignores[nignores - 1] = EARGF(usage());
+		break;
+	case 'R': /* walk directories recursively */
+		recurse = 1;
+		break;
+	case 'S': /* print each directory sorted, in walking order */
+		sorted = 1;
+		break;
 	case 'n': /* newer than file */
 	case 'o': /* older than file */
 		file = EARGF(usage());
@@ -81,29 +830,43 @@ main(int argc, char *argv[])
 			usage(); /* unknown flag */
 	} ARGEND;
 
-	if (!argc) {
+	needstat = FLAG('g') || FLAG('n') || FLAG('o') || FLAG('r')
+	        || FLAG('s') || FLAG('u') || FLAG('x');
+	if (FLAG('r') || FLAG('x')) {
+		uid = getuid();
+		if ((ngids = getgroups(0, NULL)) < 0)
+			ngids = 0;
+		gids = ecalloc(ngids + 1, sizeof *gids);
+		if ((ngids = getgroups(ngids, gids)) < 0)
+			ngids = 0;
+		gids[ngids++] = getgid();
+	}
+
+	if (recurse) {
+		if (!argc || cachefile)
+			usage();
+		walkall(argv, argc);
+	} else if (cachefile) {
+		/* the mtimes of -n and -o files are not part of the cache */
+		if (!argc || FLAG('n') || FLAG('o'))
+			usage();
+		cachescan(argv, argc);
+	} else if (!argc) {
 		/* read list from stdin */
 		while ((n = getline(&line, &linesiz, stdin)) > 0) {
 			if (n && line[n - 1] == '\n')
 				line[n - 1] = '\0';
-			test(line, line);
+			if (test(AT_FDCWD, line, line, DT_UNKNOWN, 0))
+				pass(line, NULL);
 		}
 		free(line);
 	} else {
-		for (; argc; argc--, argv++) {
-			if (FLAG('l') && (dir = opendir(*argv))) {
-				/* test directory contents */
-				while ((d = readdir(dir))) {
-					r = snprintf(path, sizeof path, "%s/%s",
-					             *argv, d->d_name);
-					if (r >= 0 && (size_t)r < sizeof path)
-						test(path, d->d_name);
-				}
-				closedir(dir);
-			} else {
-				test(*argv, *argv);
-			}
+		runs = ecalloc(argc, sizeof *runs);
+		for (i = 0; i < (size_t)argc; i++) {
+			runs[i].arg = argv[i];
+			runs[i].todo = 1;
 		}
+		scanall(runs, argc, 1);
 	}
 	return match ? 0 : 1;
 }